@@ -12,7 +12,11 @@
 #include <readline/readline.h>
 #include <assert.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <stdint.h>
+#include <inttypes.h>
 
 #ifdef DEBUG
     #define $DBG(FMT, ...) fprintf(stderr, "%s: " FMT "\n", __PRETTY_FUNCTION__, ##__VA_ARGS__)
@@ -20,11 +24,23 @@
     #define $DBG(FMT, ...)
 #endif
 
+typedef enum
+{
+    BACKEND_POLL,
+    BACKEND_EPOLL,
+
+    N_BACKENDS
+} Backend;
+
+static const char* const BACKEND_NAMES[N_BACKENDS] = {"poll", "epoll"};
+
 typedef struct
 {
-    int   is_verbose;
-    char* prog_name;
-    int   n_procs;
+    int     is_verbose;
+    char*   prog_name;
+    int     n_procs;
+    size_t  buf_cap;
+    Backend backend;
 } Args;
 
 const char* PROGNAME = NULL;    
@@ -42,12 +58,58 @@ error(char* fmt, ...)
 	return 1;
 }
 
+/* Capacity of a relay buffer unless -b is given, a pipe's worth */
+static const size_t BUFFER_CAP = 1 << 16;
+
+static int
+parseSize(const char* str, size_t* size)
+{
+    char* end = NULL;
+
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno != 0 || end == str)
+        return 1;
+
+    switch (*end)
+    {
+        case 'M': value <<= 10; /* fall through */
+        case 'K': value <<= 10; end++; break;
+        default: break;
+    }
+
+    if (*end != '\0' || value == 0 || value > (1u << 30))
+        return 1;
+
+    *size = (size_t) value;
+
+    return 0;
+}
+
+static int
+parseBackend(const char* str, Backend* backend)
+{
+    for (int i = 0; i < N_BACKENDS; i++)
+    {
+        if (strcmp(str, BACKEND_NAMES[i]) == 0)
+        {
+            *backend = (Backend) i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 static int
 parseArgs(int argc, char* argv[], Args* args)
 {
+    args->buf_cap = BUFFER_CAP;
+    args->backend = BACKEND_EPOLL;
+
     while (optind < argc)
     {
-        int opt = getopt(argc, argv, "+vn:a:");
+        int opt = getopt(argc, argv, "+vn:a:b:e:");
         switch (opt)
         {
             case -1: break;
@@ -60,6 +122,14 @@ parseArgs(int argc, char* argv[], Args* args)
             case 'a':
                 args->prog_name = optarg;
                 break;
+            case 'b':
+                if (parseSize(optarg, &args->buf_cap) != 0)
+                    return error("invalid buffer size '%s'\n", optarg);
+                break;
+            case 'e':
+                if (parseBackend(optarg, &args->backend) != 0)
+                    return error("unknown event backend '%s'\n", optarg);
+                break;
             case '?':
             default:
                 // FIXME
@@ -159,16 +229,24 @@ startProcs(int (*fildes)[2], const Args* args)
     return 0;
 }
 
-static const size_t BUFFER_CAP = 0x100;
-
+/*
+    Ring buffer relaying one link of the chain. Bytes are read in and
+    written out at the same time, each with one readv()/writev() over
+    the (at most two) pieces of the ring, so a short write costs no
+    memmove and a full buffer still takes input once some of it drains.
+    n_read and n_written only grow, the ring holds the bytes between
+    them.
+*/
 typedef struct
 {
     struct pollfd* read;
     struct pollfd* write;
 
     char*  buf;
-    size_t buf_sz;
     size_t buf_cap;
+    size_t n_read;
+    size_t n_written;
+    int    is_eof;
 
     uint64_t control_sum;
 } QueryBuffer;
@@ -184,8 +262,10 @@ queryBufferCtor(QueryBuffer* qbuf,
         return error("cannot allocate memory: %s\n", strerror(errno));
 
     qbuf->buf = tmp;
-    qbuf->buf_sz = 0;
     qbuf->buf_cap = buf_cap;
+    qbuf->n_read = 0;
+    qbuf->n_written = 0;
+    qbuf->is_eof = 0;
     qbuf->control_sum = 0;
 
     qbuf->read = read;
@@ -201,84 +281,327 @@ queryBufferDtor(QueryBuffer* qbuf)
     memset(qbuf, 0, sizeof(QueryBuffer));
 }
 
+static size_t
+queryBufferSize(const QueryBuffer* qbuf)
+{
+    return qbuf->n_read - qbuf->n_written;
+}
+
+/* Pieces of the ring covering size bytes from stream position first */
+static int
+queryBufferIov(const QueryBuffer* qbuf, size_t first, size_t size, struct iovec* iov)
+{
+    size_t offset = first % qbuf->buf_cap;
+    size_t head_sz = qbuf->buf_cap - offset;
+    if (head_sz > size)
+        head_sz = size;
+
+    iov[0].iov_base = qbuf->buf + offset;
+    iov[0].iov_len  = head_sz;
+    iov[1].iov_base = qbuf->buf;
+    iov[1].iov_len  = size - head_sz;
+
+    return iov[1].iov_len > 0 ? 2 : 1;
+}
+
 static void
 queryBufferSetPoll(QueryBuffer* qbuf)
 {
-    if (qbuf->buf_sz == 0)
+    size_t size = queryBufferSize(qbuf);
+
+    qbuf->read->events  = !qbuf->is_eof && size < qbuf->buf_cap ? POLLIN : 0;
+    qbuf->write->events = size > 0 ? POLLOUT : 0;
+
+    $DBG("r%d%s w%d%s", qbuf->read->fd, qbuf->read->events ? "+" : "",
+                        qbuf->write->fd, qbuf->write->events ? "+" : "");
+}
+
+static int
+queryBufferRead(QueryBuffer* qbuf)
+{
+    struct iovec iov[2] = {};
+    int n_iov = queryBufferIov(qbuf, qbuf->n_read, qbuf->buf_cap - queryBufferSize(qbuf), iov);
+
+    ssize_t n_read = readv(qbuf->read->fd, iov, n_iov);
+    if (n_read < 0)
+    {
+        if (errno == EAGAIN)
+            qbuf->read->revents = 0;
+
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
+
+        return error("read failed: %s\n", strerror(errno));
+    }
+
+    $DBG("read %zd from %d", n_read, qbuf->read->fd);
+
+    if (n_read == 0)
     {
-        $DBG("POLLIN %d", qbuf->read->fd);
-        qbuf->read->events = POLLIN;
-        qbuf->write->events = 0;
+        $DBG("Closing r%d on EOF", qbuf->read->fd);
+        /* stdin stays open until exit, so epollLoop can restore its flags */
+        if (qbuf->read->fd != STDIN_FILENO)
+            close(qbuf->read->fd);
+        qbuf->read->fd = -1;
+        qbuf->is_eof = 1;
+        return 0;
     }
-    else
+
+    qbuf->n_read += (size_t) n_read;
+    qbuf->control_sum += (uint64_t) n_read;
+
+    return 0;
+}
+
+static int
+queryBufferWrite(QueryBuffer* qbuf)
+{
+    struct iovec iov[2] = {};
+    int n_iov = queryBufferIov(qbuf, qbuf->n_written, queryBufferSize(qbuf), iov);
+
+    ssize_t n_written = writev(qbuf->write->fd, iov, n_iov);
+    if (n_written < 0)
     {
-        $DBG("POLLOUT %d", qbuf->write->fd);
-        qbuf->write->events = POLLOUT;
-        qbuf->read->events = 0;
+        if (errno == EAGAIN)
+            qbuf->write->revents = 0;
+
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
+
+        return error("write failed: %s\n", strerror(errno));
     }
+
+    $DBG("written %zd to %d", n_written, qbuf->write->fd);
+
+    qbuf->n_written += (size_t) n_written;
+
+    return 0;
 }
 
+/*
+    A hung up input is read until EOF, so nothing it still holds is lost;
+    POLLHUP is reported even when the ring is full and POLLIN was not asked
+    for, and a zero-sized read then would be mistaken for EOF.
+    The output is closed once the input ended and the ring is drained.
+*/
 static int 
 queryBufferAction(QueryBuffer* qbuf)
 {
-    $DBG("entered");
-    if ((qbuf->read->revents & POLLIN) != 0)
+    if (qbuf->read->fd != -1 && qbuf->read->events != 0 &&
+        (qbuf->read->revents & (POLLIN | POLLHUP | POLLERR)) != 0)
     {
-        $DBG("read %d", qbuf->read->fd);
+        if (queryBufferRead(qbuf) != 0)
+            return 1;
+    }
 
-        assert (qbuf->buf_sz == 0);
-        ssize_t n_read = read(qbuf->read->fd, qbuf->buf, qbuf->buf_cap - 1);
-        if (n_read < 0)
-            return error("read failed: %s\n", strerror(errno));
+    if (qbuf->write->fd != -1 && qbuf->write->events != 0 &&
+        (qbuf->write->revents & (POLLOUT | POLLERR)) != 0)
+    {
+        if (queryBufferWrite(qbuf) != 0)
+            return 1;
+    }
 
-        if (n_read == 0)
-        {
-            $DBG("Closing r%d w%d on EOF", qbuf->read->fd, qbuf->write->fd);
-            close(qbuf->read->fd);
+    if (qbuf->is_eof && queryBufferSize(qbuf) == 0 && qbuf->write->fd != -1)
+    {
+        $DBG("input ended, closing w%d", qbuf->write->fd);
+        if (qbuf->write->fd != STDOUT_FILENO)
             close(qbuf->write->fd);
-            qbuf->read->fd = -1;
-            qbuf->write->fd = -1;
-            
-            int status = 0;
-            wait(&status);
-            $DBG("proc returned %d", status);
+        qbuf->write->fd = -1;
+    }
+
+    return 0;
+}
+
+/*
+    Edge-triggered readiness is only reported on a change, so it is kept
+    in revents until a read or write hits EAGAIN, and the link is pumped
+    until neither side moves any more bytes.
+*/
+static int
+queryBufferPump(QueryBuffer* qbuf)
+{
+    while (1)
+    {
+        size_t n_read = qbuf->n_read;
+        size_t n_written = qbuf->n_written;
+
+        queryBufferSetPoll(qbuf);
+        if (queryBufferAction(qbuf) != 0)
+            return 1;
+
+        if (qbuf->n_read == n_read && qbuf->n_written == n_written)
             return 0;
+    }
+}
+
+static size_t
+queryBufferNOpen(const QueryBuffer* qbuf)
+{
+    return (size_t) (qbuf->read->fd != -1) + (size_t) (qbuf->write->fd != -1);
+}
+
+/* The parent's ends of the child pipes must not block a whole chain */
+static int
+setNonBlock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return error("cannot make %d non-blocking: %s\n", fd, strerror(errno));
+
+    return 0;
+}
+
+/*
+    Reference backend: every wakeup rebuilds the event mask of all links
+    and scans all of them, O(n) per wakeup however few links are ready.
+*/
+static int
+pollLoop(QueryBuffer* qbufs, struct pollfd* fds, size_t n_bufs, uint64_t* n_wakeups)
+{
+    size_t n_open = 2 * n_bufs;
+
+    while (n_open > 0)
+    {
+        for (size_t i = 0; i < n_bufs; i++)
+            queryBufferSetPoll(&qbufs[i]);
+
+        if (poll(fds, n_bufs * 2, -1) == -1 && errno != EINTR)
+            return error("poll failed: %s\n", strerror(errno));
+        (*n_wakeups)++;
+
+        for (size_t i = 0; i < n_bufs; i++)
+        {
+            size_t n_was_open = queryBufferNOpen(&qbufs[i]);
+            if (queryBufferAction(&qbufs[i]) != 0)
+                return 1;
+
+            n_open -= n_was_open - queryBufferNOpen(&qbufs[i]);
         }
+    }
+
+    return 0;
+}
+
+/* Events taken from the kernel per epoll_wait() */
+enum { EPOLL_BATCH = 64 };
 
-        qbuf->buf[n_read] = '\0';
-        qbuf->buf_sz = (size_t) n_read;
-        
-        qbuf->control_sum += (uint64_t) n_read;
+/*
+    Every fd is registered once, edge-triggered, with its index in fds as
+    the cookie, so a wakeup touches only the links that became ready.
+    Regular files cannot be polled (EPERM) and are simply always ready.
+    stdin and stdout are made non-blocking for the run, as ET needs reads
+    and writes to stop at EAGAIN, and get their saved flags back afterwards.
+*/
+static int
+epollLoop(QueryBuffer* qbufs, struct pollfd* fds, size_t n_bufs, uint64_t* n_wakeups)
+{
+    int retval = 0;
+    size_t n_open = 2 * n_bufs;
+
+    int epoll_fd = -1;
+    int stdout_flags = -1;
+    int stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+    if (stdin_flags == -1)
+    {
+        retval = error("cannot get stdin flags: %s\n", strerror(errno));
+        goto finally;
+    }
 
-        $DBG("<%s>", qbuf->buf);
+    stdout_flags = fcntl(STDOUT_FILENO, F_GETFL);
+    if (stdout_flags == -1)
+    {
+        retval = error("cannot get stdout flags: %s\n", strerror(errno));
+        goto finally;
     }
-    else if((qbuf->write->revents & POLLOUT) != 0)
+
+    if (setNonBlock(STDIN_FILENO) != 0 || setNonBlock(STDOUT_FILENO) != 0)
     {
-        $DBG("write %d", qbuf->write->fd);
-        $DBG("<%s>", qbuf->buf);
+        retval = 1;
+        goto finally;
+    }
 
-        ssize_t n_written = write(qbuf->write->fd, qbuf->buf, qbuf->buf_sz);
-        if (n_written < 0)
-            return error("write failed: %s\n", strerror(errno));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+    {
+        retval = error("epoll_create1 failed: %s\n", strerror(errno));
+        goto finally;
+    }
 
-        qbuf->buf_sz -= (size_t) n_written;
-        if (qbuf->buf_sz == 0)
-            return 0;
+    for (size_t i = 0; i < 2 * n_bufs; i++)
+    {
+        short ready = i < n_bufs ? POLLIN : POLLOUT;
+        struct epoll_event event = {.events = (uint32_t) ready | EPOLLET, .data.u64 = i};
+
+        fds[i].revents = 0;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i].fd, &event) == -1)
+        {
+            if (errno != EPERM)
+            {
+                retval = error("epoll_ctl on %d failed: %s\n", fds[i].fd, strerror(errno));
+                goto finally;
+            }
 
-        memmove(qbuf->buf, qbuf->buf + n_written, qbuf->buf_sz);
+            fds[i].revents = ready;
+        }
     }
-    
-    if ((qbuf->read->revents & POLLHUP) != 0)
+
+    for (size_t i = 0; i < n_bufs; i++)
     {
-        $DBG("pipe closed on write end %d, also closing %d", qbuf->read->fd, qbuf->write->fd);
-        close(qbuf->read->fd);
-        close(qbuf->write->fd);
-        qbuf->read->fd = -1;
-        qbuf->write->fd = -1;
+        if (queryBufferPump(&qbufs[i]) != 0)
+        {
+            retval = 1;
+            goto finally;
+        }
+
+        n_open -= 2 - queryBufferNOpen(&qbufs[i]);
     }
 
-    $DBG("leaving");
-    return 0;
+    struct epoll_event events[EPOLL_BATCH];
+    while (n_open > 0)
+    {
+        int n_events = epoll_wait(epoll_fd, events, EPOLL_BATCH, -1);
+        if (n_events == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            retval = error("epoll_wait failed: %s\n", strerror(errno));
+            goto finally;
+        }
+        (*n_wakeups)++;
+
+        for (int i = 0; i < n_events; i++)
+        {
+            size_t indx = (size_t) events[i].data.u64;
+            QueryBuffer* qbuf = &qbufs[indx % n_bufs];
+
+            /* a closed fd may still have an event queued */
+            if (fds[indx].fd == -1)
+                continue;
+
+            fds[indx].revents = (short) (fds[indx].revents | (short) events[i].events);
+
+            size_t n_was_open = queryBufferNOpen(qbuf);
+            if (queryBufferPump(qbuf) != 0)
+            {
+                retval = 1;
+                goto finally;
+            }
+
+            n_open -= n_was_open - queryBufferNOpen(qbuf);
+        }
+    }
+
+finally:
+    if (epoll_fd != -1)
+        close(epoll_fd);
+
+    if (stdin_flags != -1)
+        fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+    if (stdout_flags != -1)
+        fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
+
+    return retval;
 }
 
 static int
@@ -288,17 +611,22 @@ dispatcher(int (*pipes)[2], const Args* args)
 
     size_t n_bufs = (size_t) args->n_procs + 1;
     size_t n_procs = (size_t) args->n_procs;
-    QueryBuffer* qbufs = (QueryBuffer*) malloc(n_bufs * sizeof(QueryBuffer));
+    /* zeroed, so that a buffer whose ctor failed can still be destroyed */
+    QueryBuffer* qbufs = (QueryBuffer*) calloc(n_bufs, sizeof(QueryBuffer));
     if (!qbufs)
         return error("cannot allocate memory: %s\n", strerror(errno));
 
     struct pollfd* fds = (struct pollfd*) malloc(2 * n_bufs * sizeof(struct pollfd));
     if (!fds)
+    {
+        free(qbufs);
         return error("cannot allocate memory: %s\n", strerror(errno));
+    }
 
     struct pollfd* read_fds = fds;
     struct pollfd* write_fds = fds + n_bufs;
 
+    int retval = 0;
     for (size_t i = 0; i < n_bufs; i++)
     {
         if (i == 0)
@@ -311,36 +639,42 @@ dispatcher(int (*pipes)[2], const Args* args)
         else
             write_fds[i].fd = pipes[2 * i][1];
     
-        queryBufferCtor(&qbufs[i], BUFFER_CAP, &read_fds[i], &write_fds[i]);
+        /* a blocking pipe end would stall the whole chain, so no loop without it */
+        if (retval == 0 && i > 0)
+            retval = setNonBlock(read_fds[i].fd);
+        if (retval == 0 && i < n_procs)
+            retval = setNonBlock(write_fds[i].fd);
+
+        if (retval == 0)
+            retval = queryBufferCtor(&qbufs[i], args->buf_cap, &read_fds[i], &write_fds[i]);
         $DBG("r%d w%d", read_fds[i].fd, write_fds[i].fd);
     }
 
-    int n_connected = 0;
-    while (1)
+    uint64_t n_wakeups = 0;
+    if (retval == 0 && args->backend == BACKEND_EPOLL)
+        retval = epollLoop(qbufs, fds, n_bufs, &n_wakeups);
+    else if (retval == 0)
+        retval = pollLoop(qbufs, fds, n_bufs, &n_wakeups);
+
+    /*
+        After an error the loop leaves pipes open, and children blocked on
+        them would never exit, so everything still open is closed first.
+        Children are reaped only after the loop: blocking in wait() when
+        stdin hits EOF would stall the chain while data is still in flight.
+    */
+    for (size_t i = 0; i < 2 * n_bufs; i++)
     {
-        n_connected = 0;
-        /* check how many connections left */
-        for (size_t i = 0; i < n_bufs * 2; i++)
-        {
-            $DBG("%d", fds[i].fd);
-            n_connected += (fds[i].fd != -1);
-        }
-
-        if (!n_connected)
-            break;
-        
-        $DBG("%d", n_connected);
-        for (size_t i = 0; i < n_bufs; i++)
-            queryBufferSetPoll(&qbufs[i]);
-
-        //sleep(1);
-        poll(fds, n_bufs * 2, -1);
-
-        for (size_t i = 0; i < n_bufs; i++)
-            queryBufferAction(&qbufs[i]);
+        if (fds[i].fd != -1)
+            close(fds[i].fd);
     }
 
-    int retval = 0;
+    int status = 0;
+    while (wait(&status) > 0)
+        $DBG("proc returned %d", status);
+
+    if (args->is_verbose)
+        fprintf(stderr, "%" PRIu64 " bytes, %" PRIu64 " %s wakeups, %zu byte buffers\n",
+                qbufs[0].control_sum, n_wakeups, BACKEND_NAMES[args->backend], args->buf_cap);
 
     uint64_t control_sum = qbufs[0].control_sum;
     for (size_t i = 0; i < n_bufs; i++)
@@ -363,6 +697,21 @@ dispatcher(int (*pipes)[2], const Args* args)
     return retval;
 }
 
+/* A chain of n procs keeps 4n pipe ends open until all are forked */
+static void
+raiseFdLimit(void)
+{
+    struct rlimit limit = {};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+        {
+            $DBG("cannot raise fd limit: %s", strerror(errno));
+        }
+    }
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -378,6 +727,8 @@ main(int argc, char* argv[])
     int (*pipes)[2] = NULL;
     size_t n_procs = (size_t) args.n_procs;
 
+    raiseFdLimit();
+
     $DBG("initializing pipes");
     retval = initPipes(&pipes, 2 * n_procs);
     if (retval)
@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Helpers shared by the bench.sh scripts of the tools, to be sourced
+# after SIZE_MB and RUNS are set. Commands are usually shell functions
+# of the sourcing script; prepare runs before every timed run and can
+# be redefined after sourcing, e.g. to remove the previous output.
+#
+
+prepare()
+{
+    :
+}
+
+# Runs a command RUNS times and prints its best time and throughput
+best_of()
+{
+    name=$1
+    shift
+    best=
+
+    for run in $(seq "$RUNS")
+    do
+        prepare
+
+        start=$(date +%s%N)
+        "$@" || exit 1
+        end=$(date +%s%N)
+
+        ms=$(( (end - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$ms" -lt "$best" ]
+        then
+            best=$ms
+        fi
+    done
+
+    echo "$name: best of $RUNS: $best ms, $(( SIZE_MB * 1000 / (best ? best : 1) )) MiB/s"
+}
+
+# Page cache held by files, in MiB
+resident()
+{
+    fincore --bytes --noheadings --output RES "$@" 2>/dev/null |
+        awk '{ sum += $1 } END { print int(sum / 1048576) }'
+}
+
+#
+# Runs a copy of SRC to DST while another reader keeps going through a
+# cached 64M file HOT, and reports how much of the cache each kept.
+#
+cached_reader()
+{
+    name=$1
+    shift
+
+    [ -f "$HOT" ] || head -c 64M /dev/urandom > "$HOT"
+
+    rm -f "$DST"
+    dd if="$SRC" iflag=nocache count=0 2>/dev/null
+    cat "$HOT" > /dev/null
+
+    "$@" &
+    pid=$!
+
+    passes=0
+    start=$(date +%s%N)
+    while kill -0 "$pid" 2>/dev/null
+    do
+        cat "$HOT" > /dev/null
+        passes=$(( passes + 1 ))
+    done
+    end=$(date +%s%N)
+    wait "$pid" || exit 1
+
+    ms=$(( (end - start) / 1000000 ))
+    echo "$name: copy ${ms} ms, hot reader $(( passes * 64 * 1000 / (ms ? ms : 1) )) MiB/s," \
+         "cached after: hot $(resident "$HOT") MiB, src+dst $(resident "$SRC" "$DST") MiB"
+}
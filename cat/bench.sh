@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Compares input engines of mycat on one large regular file, then
+# measures how buffered and -d copies affect a reader of a cached file
+# running alongside.
+# usage: ./bench.sh [size_MiB] [runs]
+#
+
+SIZE_MB=${1:-256}
+RUNS=${2:-5}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+SRC="$DIR/src"
+DST="$DIR/dst"
+
+head -c "${SIZE_MB}M" /dev/urandom > "$SRC"
+
+. "$(dirname "$0")/../benchlib.sh"
+
+HOT="$DIR/hot"
+
+prepare()
+{
+    rm -f "$DST"
+}
+
+copy()
+{
+    ./mycat "$@" "$SRC" > "$DST"
+}
+
+bench()
+{
+    best_of "$1" copy -e "$1"
+    cmp -s "$SRC" "$DST" || { echo "$1: output differs" >&2; exit 1; }
+}
+
+bench rw
+bench mmap
+bench auto
+
+cached_reader buffered copy -e rw
+cached_reader direct   copy -d
@@ -1,70 +1,483 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+
+typedef enum
+{
+    ENGINE_AUTO,
+    ENGINE_MMAP,
+    ENGINE_RW,
+} engine_t;
+
+static const char* const ENGINE_NAMES[] = {
+    [ENGINE_AUTO] = "auto",
+    [ENGINE_MMAP] = "mmap",
+    [ENGINE_RW]   = "rw",
+};
 
 typedef struct
 {
     int    n_files;
     char** files_arr;
+
+    int    is_verbose;
+    size_t stream_buf_sz;
+    int    n_jobs;
+    int    is_direct;
+    engine_t engine;
 } args_t;
 
+typedef enum
+{
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_SPLICE,
+    COPY_MMAP,
+    COPY_DIRECT,
+    COPY_READ_WRITE,
+} copy_path_t;
+
+static const char* const COPY_PATH_NAMES[] = {
+    [COPY_FILE_RANGE] = "copy_file_range",
+    [COPY_SENDFILE]   = "sendfile",
+    [COPY_SPLICE]     = "splice",
+    [COPY_MMAP]       = "mmap",
+    [COPY_DIRECT]     = "direct",
+    [COPY_READ_WRITE] = "read/write",
+};
+
+/* Default buffer of stdin streaming, -b overrides it */
+static const size_t STREAM_BUF_SZ = 1 << 17;
+
+/* Files opened ahead of output per prefetch worker */
+static const int PREFETCH_PER_JOB = 4;
+
+/* Upper bound for one kernel copy call, sendfile() caps it anyway */
+static const size_t KERNEL_CHUNK = 1 << 30;
+
+/* Part of the file mapped at once by mmap engine */
+static const size_t MMAP_WINDOW = 1 << 26;
+
+/* Unit of -d transfers and alignment of its buffer */
+static const size_t DIRECT_CHUNK_SZ = 1 << 20;
+static const size_t DIRECT_ALIGN    = 4096;
+
 const char* PROGNAME = NULL;
 
 static int
-stream_write(FILE* outstream, FILE* instream, char* tmpbuf, size_t size)
+write_all(int fd, const char* buf, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n_written = write(fd, buf, size);
+        if (n_written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return 1;
+        }
+
+        buf  += n_written;
+        size -= (size_t) n_written;
+    }
+
+    return 0;
+}
+
+/*
+    Parses byte count with optional K, M or G suffix.
+*/
+static int
+parse_size(const char* str, size_t* size)
 {
-    if (fread(tmpbuf, sizeof(char), size, instream) != size)
+    char* end = NULL;
+
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno || end == str || str[0] == '-')
         return 1;
 
-    if (fwrite(tmpbuf, sizeof(char), size, outstream) != size)
+    switch (*end)
+    {
+        case 'G': value <<= 10; /* fall through */
+        case 'M': value <<= 10; /* fall through */
+        case 'K': value <<= 10; end++; break;
+        default: break;
+    }
+
+    if (*end != '\0' || value == 0)
         return 1;
 
+    *size = (size_t) value;
+
     return 0;
 }
 
+static int
+parse_engine(const char* str, engine_t* engine)
+{
+    for (size_t i = 0; i < sizeof(ENGINE_NAMES) / sizeof(ENGINE_NAMES[0]); i++)
+    {
+        if (strcmp(str, ENGINE_NAMES[i]) == 0)
+        {
+            *engine = (engine_t) i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 static int
 parse_args(int argc, char* argv[], args_t* args)
 {
-    if (getopt(argc, argv, "") != -1)
-        return 1;
-    
+    args->stream_buf_sz = STREAM_BUF_SZ;
+    args->n_jobs        = 1;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "vdb:j:e:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'v':
+                args->is_verbose = 1;
+                break;
+            case 'd':
+                args->is_direct = 1;
+                break;
+            case 'b':
+                if (parse_size(optarg, &args->stream_buf_sz) != 0)
+                {
+                    fprintf(stderr, "%s: invalid buffer size '%s'\n", PROGNAME, optarg);
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (parse_engine(optarg, &args->engine) != 0)
+                {
+                    fprintf(stderr, "%s: invalid engine '%s'\n", PROGNAME, optarg);
+                    return 1;
+                }
+                break;
+            case 'j':
+                args->n_jobs = atoi(optarg);
+                if (args->n_jobs < 1)
+                {
+                    fprintf(stderr, "%s: invalid number of jobs '%s'\n", PROGNAME, optarg);
+                    return 1;
+                }
+                break;
+            case '?':
+            default:
+                return 1;
+        }
+    }
+
     args->n_files   = argc - optind;
     args->files_arr = argv + optind;
 
     return 0;
 }
 
+/*
+    Kernel-side copy engines to try for given stdout, best first.
+    Read/write loop always closes the list.
+*/
+static size_t
+select_copy_paths(const struct stat* stat_out, copy_path_t* paths)
+{
+    size_t n_paths = 0;
+
+    if (S_ISREG(stat_out->st_mode))
+        paths[n_paths++] = COPY_FILE_RANGE;
+    else if (S_ISFIFO(stat_out->st_mode))
+        paths[n_paths++] = COPY_SPLICE;
+
+    paths[n_paths++] = COPY_SENDFILE;
+    paths[n_paths++] = COPY_READ_WRITE;
+
+    return n_paths;
+}
+
+static ssize_t
+kernel_copy_chunk(copy_path_t path, int fd_out, int fd_in, size_t size)
+{
+    switch (path)
+    {
+        case COPY_FILE_RANGE:
+            return copy_file_range(fd_in, NULL, fd_out, NULL, size, 0);
+        case COPY_SENDFILE:
+            return sendfile(fd_out, fd_in, NULL, size);
+        case COPY_SPLICE:
+            return splice(fd_in, NULL, fd_out, NULL, size, SPLICE_F_MOVE);
+        case COPY_MMAP:
+        case COPY_DIRECT:
+        case COPY_READ_WRITE:
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
 static int
-cat_interactive()
+is_path_unsupported(int err)
 {
-    int ret_val = EXIT_SUCCESS;
-    char* buffer = malloc(BUFSIZ);
+    return err == EINVAL || err == ENOSYS || err == EXDEV ||
+           err == EOPNOTSUPP || err == EBADF;
+}
 
-    if (!buffer)
-    {        
+/*
+    Returns 0 when copied up to EOF, 1 on error and -1 if path is not
+    supported for this pair of descriptors. Offset of fd_in is advanced
+    by every successful call, so the next path continues from there.
+*/
+static int
+kernel_copy(copy_path_t path, int fd_out, int fd_in)
+{
+    while (1)
+    {
+        ssize_t n_copied = kernel_copy_chunk(path, fd_out, fd_in, KERNEL_CHUNK);
+        if (n_copied > 0)
+            continue;
+
+        if (n_copied == 0)
+            return 0;
+
+        if (errno == EINTR)
+            continue;
+
+        return is_path_unsupported(errno) ? -1 : 1;
+    }
+}
+
+static int
+read_write_copy(int fd_out, int fd_in, char* buffer, size_t buffer_sz)
+{
+    while (1)
+    {
+        ssize_t n_read = read(fd_in, buffer, buffer_sz);
+        if (n_read == 0)
+            return 0;
+
+        if (n_read == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return 1;
+        }
+
+        if (write_all(fd_out, buffer, (size_t) n_read) != 0)
+            return 1;
+    }
+}
+
+/*
+    Writes the file straight from its mapping, window by window. Size is
+    re-checked before every window. The mapping is only touched by the
+    kernel, so truncation in the middle of a window makes write(2) fail
+    with EFAULT rather than raise SIGBUS; output then ends at the new
+    EOF, as it would with the read/write loop.
+    Returns -1 if the file cannot be mapped at all.
+*/
+static int
+mmap_copy(int fd_out, int fd_in, const struct stat* stat_in)
+{
+    off_t offset = 0;
+    off_t size   = stat_in->st_size;
+
+    while (offset < size)
+    {
+        struct stat statbuf = {};
+        if (fstat(fd_in, &statbuf) == -1)
+            return 1;
+
+        if (statbuf.st_size < size)
+            size = statbuf.st_size;
+
+        if (offset >= size)
+            break;
+
+        size_t len = (size_t) (size - offset);
+        if (len > MMAP_WINDOW)
+            len = MMAP_WINDOW;
+
+        char* map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd_in, offset);
+        if (map == MAP_FAILED)
+            return offset == 0 ? -1 : 1;
+
+        madvise(map, len, MADV_SEQUENTIAL);
+
+        int ret_val = write_all(fd_out, map, len);
+        int saved_errno = errno;
+        munmap(map, len);
+
+        if (ret_val != 0)
+        {
+            if (saved_errno == EFAULT && fstat(fd_in, &statbuf) == 0 &&
+                statbuf.st_size < offset + (off_t) len)
+            {
+                return 0;
+            }
+
+            errno = saved_errno;
+            return 1;
+        }
+
+        offset += (off_t) len;
+    }
+
+    return 0;
+}
+
+/*
+    Drops [offset, offset + len) of a buffered descriptor from the page
+    cache. Dirty pages cannot be dropped, so written ranges are flushed
+    first; the caller passes the previous chunk so that this wait
+    overlaps with the writeback of the current one. Start is rounded
+    down, otherwise a page shared with the previous unaligned chunk
+    would never be dropped.
+*/
+static void
+drop_cache(int fd, off_t offset, size_t len, int is_written)
+{
+    off_t start = offset & ~(off_t) (DIRECT_ALIGN - 1);
+    len   += (size_t) (offset - start);
+    offset = start;
+
+    if (is_written)
+        sync_file_range(fd, offset, (off_t) len, SYNC_FILE_RANGE_WAIT_BEFORE |
+                                                 SYNC_FILE_RANGE_WRITE |
+                                                 SYNC_FILE_RANGE_WAIT_AFTER);
+
+    posix_fadvise(fd, offset, (off_t) len, POSIX_FADV_DONTNEED);
+}
+
+static int
+set_direct(int fd, int is_on)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1)
+        return -1;
+
+    flags = is_on ? flags | O_DIRECT : flags & ~O_DIRECT;
+
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/*
+    Copies the file around the page cache. Input is read with O_DIRECT
+    if its filesystem allows it, otherwise every chunk is dropped with
+    POSIX_FADV_DONTNEED after the read. A short read leaves the offset
+    unaligned, so O_DIRECT is switched off for whatever follows it.
+    Stdout is appended to at arbitrary offsets and is never O_DIRECT;
+    when it is a regular file, written chunks are flushed and dropped.
+*/
+static int
+direct_copy(int fd_out, int fd_in, const struct stat* stat_out)
+{
+    int ret_val = 0;
+    char* buffer = NULL;
+
+    int is_direct_in = set_direct(fd_in, 1) == 0;
+
+    off_t off_in  = lseek(fd_in, 0, SEEK_CUR);
+    off_t off_out = S_ISREG(stat_out->st_mode) ? lseek(fd_out, 0, SEEK_CUR) : -1;
+
+    off_t  prev_off = 0;
+    size_t prev_len = 0;
+
+    if (posix_memalign((void**) &buffer, DIRECT_ALIGN, DIRECT_CHUNK_SZ) != 0)
+    {
         errno = ENOMEM;
-        goto error;
+        return 1;
     }
 
     while (1)
     {
-        fgets(buffer, BUFSIZ, stdin);
-        if (ferror(stdin))
-            goto error;
+        ssize_t n_read = read(fd_in, buffer, DIRECT_CHUNK_SZ);
+        if (n_read == 0)
+            break;
 
-        fputs(buffer, stdout);
-        if (ferror(stdout))
-            goto error;
+        if (n_read == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            ret_val = 1;
+            break;
+        }
+
+        size_t len = (size_t) n_read;
 
-        buffer[0] = '\0';
+        if (!is_direct_in && off_in != -1)
+            drop_cache(fd_in, off_in, len, 0);
+        else if (is_direct_in && len % DIRECT_ALIGN != 0)
+            is_direct_in = set_direct(fd_in, 0) != 0;
+
+        off_in += n_read;
+
+        if (write_all(fd_out, buffer, len) != 0)
+        {
+            ret_val = 1;
+            break;
+        }
+
+        if (off_out != -1)
+        {
+            sync_file_range(fd_out, off_out, (off_t) len, SYNC_FILE_RANGE_WRITE);
+            if (prev_len)
+                drop_cache(fd_out, prev_off, prev_len, 1);
+
+            prev_off = off_out;
+            prev_len = len;
+            off_out += n_read;
+        }
+    }
+
+    if (prev_len)
+    {
+        int saved_errno = errno;
+        drop_cache(fd_out, prev_off, prev_len, 1);
+        errno = saved_errno;
+    }
+
+    free(buffer);
+
+    return ret_val;
+}
+
+/*
+    Streams stdin to stdout with plain read(2)/write(2), so binary data
+    and long or unterminated lines cost one syscall pair per buffer.
+*/
+static int
+cat_interactive(const args_t* args)
+{
+    int ret_val = EXIT_SUCCESS;
+    char* buffer = malloc(args->stream_buf_sz);
 
-        if (feof(stdin))
-            goto finally;
+    if (!buffer)
+    {
+        errno = ENOMEM;
+        goto error;
     }
 
+    if (read_write_copy(STDOUT_FILENO, STDIN_FILENO, buffer, args->stream_buf_sz) != 0)
+        goto error;
+
+    goto finally;
+
 error:
     ret_val = EXIT_FAILURE;
     fprintf(stderr, "%s: %s\n", PROGNAME, strerror(errno));
@@ -75,67 +488,349 @@ finally:
     return ret_val;
 }
 
+/*
+    Copies opened file to stdout. Buffer for read/write fallback is
+    (re)allocated to st_blksize of the file only when it is needed.
+*/
 static int
-cat_files(args_t args)
+cat_fd(const args_t* args, const char* filename,
+       int fd_in, const struct stat* stat_in,
+       const struct stat* stat_out, char** buffer)
 {
-    char* buffer   = NULL;
-    char* filename = NULL;
-    FILE* stream   = NULL;
+    copy_path_t paths[3] = {};
+    size_t n_paths = 0;
 
-    int ret_val = EXIT_SUCCESS;
-    
-    for (int file_num = 0; file_num < args.n_files; file_num++)
+    /* procfs & co report zero size and do not support kernel copy */
+    if (S_ISREG(stat_in->st_mode) && args->is_direct)
+    {
+        paths[n_paths++] = COPY_DIRECT;
+    }
+    else if (!S_ISREG(stat_in->st_mode) || stat_in->st_size == 0 || args->engine == ENGINE_RW)
+    {
+        paths[n_paths++] = COPY_READ_WRITE;
+    }
+    else if (args->engine == ENGINE_MMAP)
+    {
+        paths[n_paths++] = COPY_MMAP;
+        paths[n_paths++] = COPY_READ_WRITE;
+    }
+    else
     {
-        filename = args.files_arr[file_num];
+        n_paths = select_copy_paths(stat_out, paths);
+    }
 
-        struct stat statbuf = {};
-        if (stat(filename, &statbuf) == -1)
-            goto error;
+    for (size_t i = 0; i < n_paths; i++)
+    {
+        int ret_val = 0;
 
-        char* new_buffer = realloc(buffer, (size_t) statbuf.st_blksize);
-        if (!new_buffer)
+        if (paths[i] == COPY_READ_WRITE)
         {
-            errno = ENOMEM;
-            goto error;
+            char* new_buffer = realloc(*buffer, (size_t) stat_in->st_blksize);
+            if (!new_buffer)
+            {
+                errno = ENOMEM;
+                return 1;
+            }
+            *buffer = new_buffer;
+
+            ret_val = read_write_copy(STDOUT_FILENO, fd_in, *buffer, (size_t) stat_in->st_blksize);
+        }
+        else if (paths[i] == COPY_MMAP)
+        {
+            ret_val = mmap_copy(STDOUT_FILENO, fd_in, stat_in);
+        }
+        else if (paths[i] == COPY_DIRECT)
+        {
+            ret_val = direct_copy(STDOUT_FILENO, fd_in, stat_out);
+        }
+        else
+        {
+            ret_val = kernel_copy(paths[i], STDOUT_FILENO, fd_in);
         }
-        buffer = new_buffer;
 
-        stream = fopen(filename, "r");
-        if (!stream)
-            goto error;
+        if (ret_val == -1)
+            continue;
+
+        if (ret_val == 0 && args->is_verbose)
+            fprintf(stderr, "%s: %s: %s\n", PROGNAME, filename, COPY_PATH_NAMES[paths[i]]);
+
+        return ret_val;
+    }
+
+    return 1;
+}
+
+static int
+open_file(const char* filename, int* fd, struct stat* statbuf)
+{
+    *fd = open(filename, O_RDONLY);
+    if (*fd == -1)
+        return 1;
+
+    if (fstat(*fd, statbuf) == -1)
+    {
+        int saved_errno = errno;
+        close(*fd);
+        *fd = -1;
+        errno = saved_errno;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************/
+
+typedef struct
+{
+    int         fd;
+    int         err;
+    int         is_ready;
+    struct stat statbuf;
+} prefetch_slot_t;
+
+/*
+    Pool of workers opening and stat'ing files ahead of the output, so
+    open/stat latency of many small files overlaps. Files are handed out
+    strictly in argv order; at most `window` of them are kept open ahead
+    of the file being written.
+*/
+typedef struct
+{
+    const args_t*    args;
+    prefetch_slot_t* slots;
+
+    int next;
+    int n_taken;
+    int window;
+    int is_stopped;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  slot_ready;
+    pthread_cond_t  window_free;
+
+    pthread_t* tids;
+    int        n_tids;
+} prefetch_t;
+
+static void*
+prefetch_worker(void* arg_ptr)
+{
+    prefetch_t* pf = (prefetch_t*) arg_ptr;
+
+    pthread_mutex_lock(&pf->mutex);
+    while (1)
+    {
+        while (!pf->is_stopped && pf->next < pf->args->n_files &&
+               pf->next >= pf->n_taken + pf->window)
+        {
+            pthread_cond_wait(&pf->window_free, &pf->mutex);
+        }
+
+        if (pf->is_stopped || pf->next == pf->args->n_files)
+            break;
+
+        int file_num = pf->next++;
+        pthread_mutex_unlock(&pf->mutex);
+
+        prefetch_slot_t* slot = &pf->slots[file_num];
+        if (open_file(pf->args->files_arr[file_num], &slot->fd, &slot->statbuf) != 0)
+            slot->err = errno;
+        else if (S_ISREG(slot->statbuf.st_mode) && !pf->args->is_direct)
+            posix_fadvise(slot->fd, 0, 0, POSIX_FADV_WILLNEED);
+
+        pthread_mutex_lock(&pf->mutex);
+        slot->is_ready = 1;
+        pthread_cond_broadcast(&pf->slot_ready);
+    }
+    pthread_mutex_unlock(&pf->mutex);
+
+    return NULL;
+}
+
+static int
+prefetch_ctor(prefetch_t* pf, const args_t* args)
+{
+    pf->args  = args;
+    pf->slots = calloc((size_t) args->n_files, sizeof(prefetch_slot_t));
+    pf->tids  = calloc((size_t) args->n_jobs, sizeof(pthread_t));
+    if (!pf->slots || !pf->tids)
+    {
+        free(pf->slots);
+        free(pf->tids);
+        errno = ENOMEM;
+
+        return 1;
+    }
+
+    for (int i = 0; i < args->n_files; i++)
+        pf->slots[i].fd = -1;
+
+    pf->next       = 0;
+    pf->n_taken    = 0;
+    pf->window     = args->n_jobs * PREFETCH_PER_JOB;
+    pf->is_stopped = 0;
+
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->slot_ready,  NULL);
+    pthread_cond_init(&pf->window_free, NULL);
+
+    for (pf->n_tids = 0; pf->n_tids < args->n_jobs; pf->n_tids++)
+    {
+        int err = pthread_create(&pf->tids[pf->n_tids], NULL, prefetch_worker, pf);
+        if (err != 0)
+        {
+            /* fewer workers is still fine, zero is not */
+            if (pf->n_tids == 0)
+            {
+                free(pf->slots);
+                free(pf->tids);
+                errno = err;
+
+                return 1;
+            }
+
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static void
+prefetch_dtor(prefetch_t* pf)
+{
+    pthread_mutex_lock(&pf->mutex);
+    pf->is_stopped = 1;
+    pthread_cond_broadcast(&pf->window_free);
+    pthread_mutex_unlock(&pf->mutex);
+
+    for (int i = 0; i < pf->n_tids; i++)
+        pthread_join(pf->tids[i], NULL);
+
+    for (int i = pf->n_taken; i < pf->args->n_files; i++)
+        if (pf->slots[i].fd != -1)
+            close(pf->slots[i].fd);
+
+    pthread_cond_destroy(&pf->window_free);
+    pthread_cond_destroy(&pf->slot_ready);
+    pthread_mutex_destroy(&pf->mutex);
+
+    free(pf->slots);
+    free(pf->tids);
+}
+
+/*
+    Waits for the next file in argv order. Ownership of the descriptor
+    passes to the caller.
+*/
+static int
+prefetch_take(prefetch_t* pf, int* fd, struct stat* statbuf)
+{
+    pthread_mutex_lock(&pf->mutex);
+
+    prefetch_slot_t* slot = &pf->slots[pf->n_taken];
+    while (!slot->is_ready)
+        pthread_cond_wait(&pf->slot_ready, &pf->mutex);
+
+    pf->n_taken++;
+    pthread_cond_signal(&pf->window_free);
+    pthread_mutex_unlock(&pf->mutex);
+
+    if (slot->err)
+    {
+        errno = slot->err;
+        return 1;
+    }
 
-        if (setvbuf(stream, NULL, _IONBF, 0) != 0)
+    *fd      = slot->fd;
+    *statbuf = slot->statbuf;
+    slot->fd = -1;
+
+    return 0;
+}
+
+/******************************************************************************/
+
+/*
+    Copies run to EOF, so appending a file to itself would never end.
+    Refused like GNU cat does.
+*/
+static int
+is_same_file(const struct stat* stat_in, const struct stat* stat_out)
+{
+    return S_ISREG(stat_out->st_mode) &&
+           stat_in->st_dev == stat_out->st_dev &&
+           stat_in->st_ino == stat_out->st_ino;
+}
+
+static int
+cat_files(const args_t* args, const struct stat* stat_out)
+{
+    char* buffer   = NULL;
+    char* filename = NULL;
+    int   fd       = -1;
+
+    prefetch_t  prefetch = {};
+    prefetch_t* pf       = NULL;
+
+    int ret_val = EXIT_SUCCESS;
+
+    if (args->n_jobs > 1 && args->n_files > 1)
+    {
+        if (prefetch_ctor(&prefetch, args) != 0)
             goto error;
 
-        long n_blocks = statbuf.st_size / statbuf.st_blksize;
-        long tail_sz  = statbuf.st_size % statbuf.st_blksize;
-        
-        for (long i = 0; i < n_blocks; i++)
+        pf = &prefetch;
+    }
+
+    for (int file_num = 0; file_num < args->n_files; file_num++)
+    {
+        filename = args->files_arr[file_num];
+
+        struct stat statbuf = {};
+        if (pf)
         {
-            if (stream_write(stdout, stream, buffer, (size_t) statbuf.st_blksize) != 0)
+            if (prefetch_take(pf, &fd, &statbuf) != 0)
                 goto error;
         }
-
-        if (tail_sz)
+        else
         {
-            if (stream_write(stdout, stream, buffer, (size_t) tail_sz) != 0)
+            if (open_file(filename, &fd, &statbuf) != 0)
                 goto error;
         }
 
-        fclose(stream);
-        stream = NULL;
+        if (is_same_file(&statbuf, stat_out))
+        {
+            fprintf(stderr, "%s: %s: input file is output file\n", PROGNAME, filename);
+            ret_val = EXIT_FAILURE;
+        }
+        else if (cat_fd(args, filename, fd, &statbuf, stat_out, &buffer) != 0)
+        {
+            goto error;
+        }
+
+        close(fd);
+        fd = -1;
     }
 
     goto finally;
 
 error:
     ret_val = EXIT_FAILURE;
-    fprintf(stderr, "%s: %s: %s\n", PROGNAME, filename, strerror(errno));
+    if (filename)
+        fprintf(stderr, "%s: %s: %s\n", PROGNAME, filename, strerror(errno));
+    else
+        fprintf(stderr, "%s: %s\n", PROGNAME, strerror(errno));
 
-    if(stream)
-        fclose(stream);
+    if (fd != -1)
+        close(fd);
 
 finally:
+    if (pf)
+        prefetch_dtor(pf);
+
     free(buffer);
 
     return ret_val;
@@ -152,11 +847,18 @@ main(int argc, char* argv[])
 
     if (args.n_files == 0)
     {
-        return cat_interactive();
+        return cat_interactive(&args);
     }
     else
     {
-        return cat_files(args);
+        struct stat stat_out = {};
+        if (fstat(STDOUT_FILENO, &stat_out) == -1)
+        {
+            fprintf(stderr, "%s: stdout: %s\n", PROGNAME, strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        return cat_files(&args, &stat_out);
     }
 
     return EXIT_FAILURE;
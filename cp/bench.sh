@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Compares copy engines of mycp on one large regular file, sweeps block
+# size and queue depth of the io_uring engine, then measures how buffered
+# and --direct copies affect a reader of a cached file running alongside.
+# usage: ./bench.sh [size_MiB] [runs]
+# BENCH_DIR selects where the files live, e.g. a tmpfs or a loop mount.
+#
+
+SIZE_MB=${1:-256}
+RUNS=${2:-5}
+
+DIR=$(mktemp -d "${BENCH_DIR:-/tmp}/mycp.XXXXXX")
+trap 'rm -rf "$DIR"' EXIT
+
+SRC="$DIR/src"
+DST="$DIR/dst"
+
+head -c "${SIZE_MB}M" /dev/urandom > "$SRC"
+
+. "$(dirname "$0")/../benchlib.sh"
+
+HOT="$DIR/hot"
+
+prepare()
+{
+    rm -f "$DST"
+}
+
+copy()
+{
+    ./mycp "$@" "$SRC" "$DST"
+}
+
+bench()
+{
+    name=$1
+    shift
+
+    best_of "$name" copy "$@"
+    cmp -s "$SRC" "$DST" || { echo "$name: output differs" >&2; exit 1; }
+}
+
+bench rw    -e rw
+bench mmap  -e mmap
+bench range -e range
+bench uring -e uring
+bench auto
+
+for bs in 16K 128K 1M
+do
+    for qd in 1 4 16 64
+    do
+        bench "uring bs=$bs qd=$qd" -e uring --block-size=$bs --queue-depth=$qd
+    done
+done
+
+cached_reader buffered copy -e rw
+cached_reader direct   copy --direct
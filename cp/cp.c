@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -5,9 +6,103 @@
 #include <libgen.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+typedef enum
+{
+    ENGINE_AUTO,
+    ENGINE_REFLINK,
+    ENGINE_RANGE,
+    ENGINE_MMAP,
+    ENGINE_URING,
+    ENGINE_DIRECT,
+    ENGINE_RW,
+} engine_t;
+
+static const char* const ENGINE_NAMES[] = {
+    [ENGINE_AUTO]    = "auto",
+    [ENGINE_REFLINK] = "reflink",
+    [ENGINE_RANGE]   = "range",
+    [ENGINE_MMAP]    = "mmap",
+    [ENGINE_URING]   = "uring",
+    [ENGINE_DIRECT]  = "direct",
+    [ENGINE_RW]      = "rw",
+};
+
+typedef enum
+{
+    SPARSE_AUTO,
+    SPARSE_ALWAYS,
+    SPARSE_NEVER,
+} sparse_t;
+
+static const char* const SPARSE_NAMES[] = {
+    [SPARSE_AUTO]   = "auto",
+    [SPARSE_ALWAYS] = "always",
+    [SPARSE_NEVER]  = "never",
+};
+
+static const struct option LONG_OPTIONS[] = {
+    {"sparse",      required_argument, NULL, 'S'},
+    {"inflight",    required_argument, NULL, 'I'},
+    {"queue-depth", required_argument, NULL, 'Q'},
+    {"block-size",  required_argument, NULL, 'B'},
+    {"resume",      no_argument,       NULL, 'U'},
+    {"journal",     no_argument,       NULL, 'J'},
+    {"direct",      no_argument,       NULL, 'D'},
+    {NULL,          0,                 NULL,  0 },
+};
+
+/* Part of the source mapped at once by mmap engine */
+static const size_t MMAP_WINDOW = 1 << 26;
+
+/* Default limit of file bytes being copied at once by -r workers */
+static const size_t INFLIGHT_BUDGET = 1 << 28;
+
+static const size_t DEQUE_INIT_CAP = 64;
+
+/* Defaults of uring engine: requests in flight and size of each */
+static const size_t URING_QUEUE_DEPTH = 8;
+static const size_t URING_BLOCK_SZ    = 1 << 17;
+static const size_t URING_ALIGN       = 4096;
+
+/* Unit of --resume verification and of --journal records */
+static const size_t RESUME_CHUNK_SZ = 1 << 20;
+
+/* Chunks written between two journal flushes */
+static const size_t JOURNAL_BATCH = 64;
+
+/* Unit of --direct transfers and alignment of its buffer */
+static const size_t DIRECT_CHUNK_SZ = 1 << 20;
+static const size_t DIRECT_ALIGN    = 4096;
+
+static const char JOURNAL_SUFFIX[] = ".cpjournal";
+static const char JOURNAL_MAGIC[8] = "CPJRNL1";
+
+/*
+    Sidecar journal: this header followed by uint64_t indices of chunks
+    already durable in the destination.
+*/
+typedef struct
+{
+    char     magic[8];
+    uint64_t src_size;
+    int64_t  src_mtime_sec;
+    int64_t  src_mtime_nsec;
+    uint64_t chunk_sz;
+} journal_header_t;
 
 typedef struct
 {
@@ -18,6 +113,19 @@ typedef struct
     int    is_interactive;
     int    is_verbose;
     int    is_force; 
+    int    is_recursive;
+    int    is_resume;
+    int    is_journal;
+    int    is_direct;
+
+    engine_t engine;
+    sparse_t sparse;
+
+    int    n_jobs;
+    size_t inflight;
+
+    size_t queue_depth;
+    size_t block_size;
 } args_t;
 
 const char* PROGNAME = NULL;    
@@ -25,6 +133,7 @@ const char* PROGNAME = NULL;
 static int
 error(char* fmt, ...)
 {
+    flockfile(stderr);
     fprintf(stderr, "%s: ", PROGNAME);
 
 	va_list args = {};
@@ -32,9 +141,101 @@ error(char* fmt, ...)
 	vfprintf(stderr, fmt, args);
 	va_end(args);
 
+    funlockfile(stderr);
+
 	return 1;
 }
 
+static int
+write_all(int fd, const char* buf, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n_written = write(fd, buf, size);
+        if (n_written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return 1;
+        }
+
+        buf  += n_written;
+        size -= (size_t) n_written;
+    }
+
+    return 0;
+}
+
+static int
+write_all_at(int fd, const char* buf, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t n_written = pwrite(fd, buf, size, offset);
+        if (n_written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return 1;
+        }
+
+        buf    += n_written;
+        size   -= (size_t) n_written;
+        offset += n_written;
+    }
+
+    return 0;
+}
+
+/*
+    Parses byte count with optional K, M or G suffix.
+*/
+static int
+parse_size(const char* str, size_t* size)
+{
+    char* end = NULL;
+
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno || end == str || str[0] == '-')
+        return 1;
+
+    switch (*end)
+    {
+        case 'G': value <<= 10; /* fall through */
+        case 'M': value <<= 10; /* fall through */
+        case 'K': value <<= 10; end++; break;
+        default: break;
+    }
+
+    if (*end != '\0' || value == 0)
+        return 1;
+
+    *size = (size_t) value;
+
+    return 0;
+}
+
+/*
+    Looks str up in a table of option values, index is stored to value.
+*/
+static int
+parse_name(const char* str, const char* const* names, size_t n_names, int* value)
+{
+    for (size_t i = 0; i < n_names; i++)
+    {
+        if (strcmp(str, names[i]) == 0)
+        {
+            *value = (int) i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 static int
 parse_args(int argc, char* argv[], args_t* args)
 {
@@ -43,9 +244,16 @@ parse_args(int argc, char* argv[], args_t* args)
     if (!file_arr)
         return error("%s\n", strerror(errno));
 
+    args->n_jobs   = 1;
+    args->inflight = INFLIGHT_BUDGET;
+
+    args->queue_depth = URING_QUEUE_DEPTH;
+    args->block_size  = URING_BLOCK_SZ;
+
     while (optind < argc)
     {
-        int opt = getopt(argc, argv, "+ivf");
+        int opt = getopt_long(argc, argv, "+ivfrRe:j:", LONG_OPTIONS, NULL);
+        int value = 0;
         switch (opt)
         {
             case -1:
@@ -59,6 +267,70 @@ parse_args(int argc, char* argv[], args_t* args)
             case 'f':
                 args->is_force = 1;
                 continue;
+            case 'r':
+            case 'R':
+                args->is_recursive = 1;
+                continue;
+            case 'j':
+                args->n_jobs = atoi(optarg);
+                if (args->n_jobs < 1)
+                {
+                    free(file_arr);
+
+                    return error("invalid number of jobs '%s'\n", optarg);
+                }
+                continue;
+            case 'I':
+                if (parse_size(optarg, &args->inflight) != 0)
+                {
+                    free(file_arr);
+
+                    return error("invalid in-flight budget '%s'\n", optarg);
+                }
+                continue;
+            case 'Q':
+                if (parse_size(optarg, &args->queue_depth) != 0 || args->queue_depth > 4096)
+                {
+                    free(file_arr);
+
+                    return error("invalid queue depth '%s'\n", optarg);
+                }
+                continue;
+            case 'U':
+                args->is_resume = 1;
+                continue;
+            case 'J':
+                args->is_journal = 1;
+                continue;
+            case 'D':
+                args->is_direct = 1;
+                continue;
+            case 'B':
+                if (parse_size(optarg, &args->block_size) != 0 || args->block_size > (1u << 30))
+                {
+                    free(file_arr);
+
+                    return error("invalid block size '%s'\n", optarg);
+                }
+                continue;
+            case 'e':
+                if (parse_name(optarg, ENGINE_NAMES, sizeof(ENGINE_NAMES) / sizeof(ENGINE_NAMES[0]), &value) != 0)
+                {
+                    free(file_arr);
+
+                    return error("invalid copy engine '%s'\n", optarg);
+                }
+                args->engine = (engine_t) value;
+                continue;
+            case 'S':
+                if (parse_name(optarg, SPARSE_NAMES, sizeof(SPARSE_NAMES) / sizeof(SPARSE_NAMES[0]), &value) != 0)
+                {
+                    free(file_arr);
+
+                    return error("invalid sparse mode '%s'\n", optarg);
+                }
+                args->sparse = (sparse_t) value;
+                continue;
             case '?':
             default:
                 // FIXME
@@ -103,8 +375,12 @@ parse_args(int argc, char* argv[], args_t* args)
 static int
 is_overwrite(args_t* args, char* dst)
 {
+    /* -r workers may ask concurrently */
+    static pthread_mutex_t prompt_mutex = PTHREAD_MUTEX_INITIALIZER;
+
     if (args->is_interactive)
     {
+        pthread_mutex_lock(&prompt_mutex);
         fprintf(stderr, "%s: overwrite '%s'? ", PROGNAME, dst);
 
         int ch = getchar();
@@ -112,6 +388,8 @@ is_overwrite(args_t* args, char* dst)
         while ((tmp = getchar()) != '\n' && ch != EOF)
             ;
 
+        pthread_mutex_unlock(&prompt_mutex);
+
         return ch == 'y';
     }
 
@@ -119,53 +397,37 @@ is_overwrite(args_t* args, char* dst)
 }
 
 static int
-copy_file(args_t* args,
-          char* file_src, struct stat* stat_src,
-          char* file_dst, struct stat* stat_dst)
+preserve_metadata(char* file_dst, int fd_dst, struct stat* stat_src)
 {
-    int fd_src = -1;
-    int fd_dst = -1;
-    char* buffer = NULL;
-
-    int retval = 0;
-
-    if (S_ISDIR(stat_src->st_mode))
-        return error("%s: %s\n", file_src, strerror(EISDIR));
-
-    if (stat_dst &&
-        stat_dst->st_dev == stat_src->st_dev &&
-        stat_dst->st_ino == stat_src->st_ino)
-    {
-        return error("'%s' and '%s' are the same file\n", file_src, file_dst);
-    }
+    struct timespec times[2] = {stat_src->st_atim, stat_src->st_mtim};
 
-    if (stat_dst)
+    if (fd_dst != -1)
     {
-        if (!is_overwrite(args, file_dst))
-            return 0;
-        
-        if (args->is_force)
-            if(unlink(file_dst) == -1)
-                return error("cannot remove '%s': %s", file_dst, strerror(errno));
+        if (fchmod(fd_dst, stat_src->st_mode & 07777) == -1 ||
+            futimens(fd_dst, times) == -1)
+        {
+            return error("%s: cannot preserve metadata: %s\n", file_dst, strerror(errno));
+        }
     }
-
-    fd_src = open(file_src, O_RDONLY);
-    if (fd_src == -1)
+    else
     {
-        retval = error("%s: %s\n", file_src, strerror(errno));
-
-        goto finally;
+        if (chmod(file_dst, stat_src->st_mode & 07777) == -1 ||
+            utimensat(AT_FDCWD, file_dst, times, 0) == -1)
+        {
+            return error("%s: cannot preserve metadata: %s\n", file_dst, strerror(errno));
+        }
     }
 
-    fd_dst = open(file_dst, O_WRONLY | O_CREAT | O_TRUNC, stat_src->st_mode);
-    if (fd_dst == -1)
-    {
-        retval = error("%s: %s\n", file_dst, strerror(errno));
+    return 0;
+}
 
-        goto finally;
-    }
+static int
+copy_rw(char* file_src, int fd_src, struct stat* stat_src,
+        char* file_dst, int fd_dst)
+{
+    int retval = 0;
 
-    buffer = calloc((size_t) stat_src->st_blksize, sizeof(char));
+    char* buffer = calloc((size_t) stat_src->st_blksize, sizeof(char));
     if (!buffer)
     {
         retval = error("%s\n", strerror(errno));
@@ -211,18 +473,1844 @@ finally:
 
     free(buffer);
 
-    if (fd_src != -1)
-        close(fd_src);
+    return retval;
+}
 
-    if (fd_dst != -1)
-        close(fd_dst);
+static int
+is_unsupported(int err)
+{
+    return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV ||
+           err == EINVAL || err == ENOSYS;
+}
 
-    if (args->is_verbose && retval == 0)
-        fprintf(stderr, "'%s' -> '%s'\n", file_src, file_dst);
+/*
+    Shares source extents with the destination (btrfs, XFS, ...), no
+    data is read or written. Returns -1 if the filesystem cannot do it.
+*/
+static int
+copy_reflink(int fd_src, char* file_dst, int fd_dst)
+{
+    if (ioctl(fd_dst, FICLONE, fd_src) == 0)
+        return 0;
+
+    if (is_unsupported(errno))
+        return -1;
+
+    return error("%s: %s\n", file_dst, strerror(errno));
+}
+
+/*
+    In-kernel copy, no round trip of the data through user space.
+    Returns -1 if it is not supported for this pair of files.
+*/
+static int
+copy_range(char* file_src, int fd_src, struct stat* stat_src,
+           char* file_dst, int fd_dst)
+{
+    off_t copied = 0;
+
+    while (copied < stat_src->st_size)
+    {
+        ssize_t n_copied = copy_file_range(fd_src, NULL, fd_dst, NULL,
+                                           (size_t) (stat_src->st_size - copied), 0);
+        if (n_copied == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if (copied == 0 && is_unsupported(errno))
+                return -1;
+
+            return error("'%s' -> '%s': %s\n", file_src, file_dst, strerror(errno));
+        }
+
+        if (n_copied == 0)
+            return error("%s: file shrank during copy\n", file_src);
+
+        copied += n_copied;
+    }
+
+    return 0;
+}
+
+static int
+is_zero_block(const char* buf, size_t size)
+{
+    return size == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0);
+}
+
+/*
+    Copies only data extents of the source found with SEEK_DATA and
+    SEEK_HOLE, holes are left unallocated in the destination. In
+    --sparse=always mode st_blksize blocks of zeroes inside data extents
+    are skipped too. Extents go through copy_file_range when the engine
+    allows it, through pread/pwrite otherwise.
+*/
+static int
+copy_sparse(args_t* args,
+            char* file_src, int fd_src, struct stat* stat_src,
+            char* file_dst, int fd_dst, engine_t* used)
+{
+    char* buffer = NULL;
+    size_t buffer_sz = (size_t) stat_src->st_blksize;
+
+    int is_range = args->sparse != SPARSE_ALWAYS &&
+                   (args->engine == ENGINE_AUTO || args->engine == ENGINE_RANGE);
+
+    int retval = 0;
+    off_t data = 0;
+
+    while (data < stat_src->st_size)
+    {
+        data = lseek(fd_src, data, SEEK_DATA);
+        if (data == -1)
+        {
+            /* no data up to EOF */
+            if (errno == ENXIO)
+                break;
+
+            retval = error("%s: %s\n", file_src, strerror(errno));
+            goto finally;
+        }
+
+        off_t hole = lseek(fd_src, data, SEEK_HOLE);
+        if (hole == -1)
+        {
+            retval = error("%s: %s\n", file_src, strerror(errno));
+            goto finally;
+        }
+
+        if (hole > stat_src->st_size)
+            hole = stat_src->st_size;
+
+        while (is_range && data < hole)
+        {
+            off_t off_dst = data;
+            ssize_t n_copied = copy_file_range(fd_src, &data, fd_dst, &off_dst, (size_t) (hole - data), 0);
+            if (n_copied > 0)
+                continue;
+
+            if (n_copied == -1 && errno == EINTR)
+                continue;
+
+            if (n_copied == -1 && is_unsupported(errno))
+            {
+                is_range = 0;
+                break;
+            }
+
+            retval = n_copied == 0 ? error("%s: file shrank during copy\n", file_src)
+                                   : error("'%s' -> '%s': %s\n", file_src, file_dst, strerror(errno));
+            goto finally;
+        }
+
+        if (!buffer && data < hole)
+        {
+            buffer = (char*) malloc(buffer_sz);
+            if (!buffer)
+            {
+                retval = error("%s\n", strerror(errno));
+                goto finally;
+            }
+        }
+
+        while (data < hole)
+        {
+            size_t len = (size_t) (hole - data);
+            if (len > buffer_sz)
+                len = buffer_sz;
+
+            ssize_t n_read = pread(fd_src, buffer, len, data);
+            if (n_read == -1 && errno == EINTR)
+                continue;
+
+            if (n_read <= 0)
+            {
+                retval = n_read == 0 ? error("%s: file shrank during copy\n", file_src)
+                                     : error("%s: %s\n", file_src, strerror(errno));
+                goto finally;
+            }
+
+            if (args->sparse != SPARSE_ALWAYS || !is_zero_block(buffer, (size_t) n_read))
+            {
+                if (write_all_at(fd_dst, buffer, (size_t) n_read, data) != 0)
+                {
+                    retval = error("%s: %s\n", file_dst, strerror(errno));
+                    goto finally;
+                }
+            }
+
+            data += n_read;
+        }
+
+        data = hole;
+    }
+
+    /* trailing hole */
+    if (ftruncate(fd_dst, stat_src->st_size) == -1)
+        retval = error("%s: %s\n", file_dst, strerror(errno));
+
+finally:
+    *used = is_range ? ENGINE_RANGE : ENGINE_RW;
+    free(buffer);
 
     return retval;
 }
 
+/*
+    Writes the destination straight from the mapping of the source,
+    window by window. Source size is re-checked before every window;
+    truncation in the middle of one makes write(2) fail with EFAULT
+    (the mapping is touched only by the kernel, so no SIGBUS).
+    Returns -1 if the source cannot be mapped at all.
+*/
+static int
+copy_mmap(char* file_src, int fd_src, struct stat* stat_src,
+          char* file_dst, int fd_dst)
+{
+    off_t offset = 0;
+
+    while (offset < stat_src->st_size)
+    {
+        struct stat statbuf = {};
+        if (fstat(fd_src, &statbuf) == -1)
+            return error("%s: %s\n", file_src, strerror(errno));
+
+        if (statbuf.st_size < stat_src->st_size)
+            return error("%s: file shrank during copy\n", file_src);
+
+        size_t len = (size_t) (stat_src->st_size - offset);
+        if (len > MMAP_WINDOW)
+            len = MMAP_WINDOW;
+
+        char* map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd_src, offset);
+        if (map == MAP_FAILED)
+        {
+            if (offset == 0)
+                return -1;
+
+            return error("%s: %s\n", file_src, strerror(errno));
+        }
+
+        madvise(map, len, MADV_SEQUENTIAL);
+
+        int write_err = write_all(fd_dst, map, len) ? errno : 0;
+        munmap(map, len);
+
+        if (write_err)
+        {
+            if (write_err == EFAULT && fstat(fd_src, &statbuf) == 0 &&
+                statbuf.st_size < stat_src->st_size)
+            {
+                return error("%s: file shrank during copy\n", file_src);
+            }
+
+            return error("%s: %s\n", file_dst, strerror(write_err));
+        }
+
+        offset += (off_t) len;
+    }
+
+    return 0;
+}
+
+/*
+    Drops [offset, offset + len) of a buffered descriptor from the page
+    cache. Dirty pages cannot be dropped, so written ranges are flushed
+    first; callers pass the previous chunk to overlap this wait with the
+    writeback of the current one.
+*/
+static void
+drop_cache(int fd, off_t offset, size_t len, int is_written)
+{
+    if (is_written)
+        sync_file_range(fd, offset, (off_t) len, SYNC_FILE_RANGE_WAIT_BEFORE |
+                                                 SYNC_FILE_RANGE_WRITE |
+                                                 SYNC_FILE_RANGE_WAIT_AFTER);
+
+    posix_fadvise(fd, offset, (off_t) len, POSIX_FADV_DONTNEED);
+}
+
+static int
+set_direct(int fd, int is_on)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1)
+        return -1;
+
+    flags = is_on ? flags | O_DIRECT : flags & ~O_DIRECT;
+
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/*
+    Copies around the page cache: each side is switched to O_DIRECT if
+    its filesystem allows it, otherwise chunks are dropped from the cache
+    with POSIX_FADV_DONTNEED right after use. The unaligned tail of the
+    destination is written through the cache and dropped the same way.
+    With `is_holes` zero chunks are skipped instead of written.
+*/
+static int
+copy_direct(char* file_src, int fd_src, struct stat* stat_src,
+            char* file_dst, int fd_dst, int is_holes)
+{
+    int retval = 0;
+    char* buffer = NULL;
+
+    int is_direct_src = set_direct(fd_src, 1) == 0;
+    int is_direct_dst = set_direct(fd_dst, 1) == 0;
+
+    off_t  prev_off = 0;
+    size_t prev_len = 0;
+
+    if (posix_memalign((void**) &buffer, DIRECT_ALIGN, DIRECT_CHUNK_SZ) != 0)
+    {
+        buffer = NULL;
+        retval = error("%s\n", strerror(ENOMEM));
+        goto finally;
+    }
+
+    for (off_t offset = 0; offset < stat_src->st_size; )
+    {
+        ssize_t n_read = pread(fd_src, buffer, DIRECT_CHUNK_SZ, offset);
+        if (n_read == -1 && errno == EINTR)
+            continue;
+
+        if (n_read <= 0)
+        {
+            retval = n_read == 0 ? error("%s: file shrank during copy\n", file_src)
+                                 : error("%s: %s\n", file_src, strerror(errno));
+            goto finally;
+        }
+
+        size_t len = (size_t) n_read;
+
+        if (!is_direct_src)
+            drop_cache(fd_src, offset, len, 0);
+
+        if (is_direct_dst && len % DIRECT_ALIGN != 0)
+        {
+            set_direct(fd_dst, 0);
+            is_direct_dst = 0;
+        }
+
+        if (!is_holes || !is_zero_block(buffer, len))
+        {
+            if (write_all_at(fd_dst, buffer, len, offset) != 0)
+            {
+                retval = error("%s: %s\n", file_dst, strerror(errno));
+                goto finally;
+            }
+
+            if (!is_direct_dst)
+            {
+                sync_file_range(fd_dst, offset, (off_t) len, SYNC_FILE_RANGE_WRITE);
+                if (prev_len)
+                    drop_cache(fd_dst, prev_off, prev_len, 1);
+
+                prev_off = offset;
+                prev_len = len;
+            }
+        }
+
+        offset += n_read;
+    }
+
+    if (prev_len)
+        drop_cache(fd_dst, prev_off, prev_len, 1);
+
+    if (is_holes && ftruncate(fd_dst, stat_src->st_size) == -1)
+        retval = error("%s: %s\n", file_dst, strerror(errno));
+
+finally:
+    free(buffer);
+
+    return retval;
+}
+
+/*
+    Minimal io_uring wrapper over raw syscalls, the tree has no liburing.
+    Only this thread touches the rings, so plain loads are fine for our
+    own indices; kernel-owned ones use acquire/release.
+*/
+typedef struct
+{
+    int ring_fd;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned  sq_entries;
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void*  sq_ring;
+    size_t sq_ring_sz;
+    void*  cq_ring;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+
+    unsigned n_to_submit;
+} uring_t;
+
+static void
+uring_dtor(uring_t* ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_sz);
+
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_sz);
+
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_sz);
+
+    close(ring->ring_fd);
+    memset(ring, 0, sizeof(uring_t));
+}
+
+static int
+uring_ctor(uring_t* ring, unsigned entries)
+{
+    struct io_uring_params params = {};
+
+    memset(ring, 0, sizeof(uring_t));
+
+    ring->ring_fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->ring_fd == -1)
+        return 1;
+
+    ring->sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_sz    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    int is_single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (is_single && ring->cq_ring_sz > ring->sq_ring_sz)
+        ring->sq_ring_sz = ring->cq_ring_sz;
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        uring_dtor(ring);
+        return 1;
+    }
+
+    ring->cq_ring = is_single ? ring->sq_ring
+                              : mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+    {
+        ring->cq_ring = NULL;
+        uring_dtor(ring);
+        return 1;
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_dtor(ring);
+        return 1;
+    }
+
+    char* sq = (char*) ring->sq_ring;
+    ring->sq_head    = (unsigned*) (void*) (sq + params.sq_off.head);
+    ring->sq_tail    = (unsigned*) (void*) (sq + params.sq_off.tail);
+    ring->sq_mask    = (unsigned*) (void*) (sq + params.sq_off.ring_mask);
+    ring->sq_array   = (unsigned*) (void*) (sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    char* cq = (char*) ring->cq_ring;
+    ring->cq_head = (unsigned*) (void*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (void*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (void*) (cq + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe*) (void*) (cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+/*
+    Queues one request; caller keeps at most sq_entries of them in
+    flight, so the ring is never full.
+*/
+static void
+uring_prep(uring_t* ring, int opcode, int fd, char* buf, size_t len,
+           off_t offset, int buf_index, size_t user_data)
+{
+    unsigned tail  = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    sqe->opcode    = (__u8) opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (__u64) (uintptr_t) buf;
+    sqe->len       = (__u32) len;
+    sqe->off       = (__u64) offset;
+    sqe->buf_index = (__u16) buf_index;
+    sqe->user_data = (__u64) user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->n_to_submit++;
+}
+
+/* Queues a cancel of every request in flight, tagged with user_data */
+static int
+uring_prep_cancel_all(uring_t* ring, size_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        return 1;
+
+    unsigned index = tail & *ring->sq_mask;
+
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+    sqe->fd           = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data    = (__u64) user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->n_to_submit++;
+
+    return 0;
+}
+
+static int
+uring_submit_and_wait(uring_t* ring)
+{
+    while (1)
+    {
+        long n_submitted = syscall(__NR_io_uring_enter, ring->ring_fd, ring->n_to_submit,
+                                   1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n_submitted >= 0)
+        {
+            ring->n_to_submit -= (unsigned) n_submitted;
+            return 0;
+        }
+
+        if (errno != EINTR)
+            return 1;
+    }
+}
+
+typedef struct
+{
+    off_t  offset;
+    size_t len;
+    size_t done;
+    int    is_writing;
+} uring_slot_t;
+
+static void
+uring_slot_submit(uring_t* ring, uring_slot_t* slot, size_t index,
+                  char* buffer, int is_fixed, int fd_src, int fd_dst)
+{
+    int opcode = 0;
+    if (slot->is_writing)
+        opcode = is_fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    else
+        opcode = is_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+
+    uring_prep(ring, opcode, slot->is_writing ? fd_dst : fd_src,
+               buffer + slot->done, slot->len - slot->done,
+               slot->offset + (off_t) slot->done, is_fixed ? (int) index : 0, index);
+}
+
+/*
+    Closing the ring neither cancels nor waits for requests in flight,
+    teardown is asynchronous and a pending read could still land in the
+    buffers after they are freed. So whatever is left is cancelled and
+    reaped. Returns 1 if that is impossible too, then the buffers must
+    be leaked rather than freed.
+*/
+static int
+uring_cancel_and_drain(uring_t* ring, size_t n_active, size_t cancel_tag)
+{
+    int is_cancelling = uring_prep_cancel_all(ring, cancel_tag) == 0;
+
+    while (n_active > 0 || is_cancelling)
+    {
+        size_t n_reaped = 0;
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++, n_reaped++)
+        {
+            /* cancelled or not, every request completes exactly once */
+            if (ring->cqes[head & *ring->cq_mask].user_data == cancel_tag)
+                is_cancelling = 0;
+            else
+                n_active--;
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (n_active == 0 && !is_cancelling)
+            break;
+
+        /* a full completion queue (EBUSY) is worth another try once reaped */
+        if (uring_submit_and_wait(ring) != 0 && n_reaped == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+    Keeps queue_depth block_size requests in flight over a set of
+    registered buffers. Each buffer cycles read -> write -> next read,
+    so reads of later blocks overlap writes of earlier ones. Short
+    transfers are resubmitted for the rest. On error no new reads are
+    issued, but the ones in flight are drained before the buffers go;
+    if the ring itself fails they are cancelled and reaped instead.
+    Returns -1 if io_uring is not available.
+*/
+static int
+copy_uring(args_t* args,
+           char* file_src, int fd_src, struct stat* stat_src,
+           char* file_dst, int fd_dst)
+{
+    size_t n_slots = args->queue_depth;
+    size_t blk_sz  = args->block_size;
+
+    uring_t ring = {};
+    if (uring_ctor(&ring, (unsigned) n_slots) != 0)
+        return -1;
+
+    int retval    = 0;
+    int is_leaked = 0;
+
+    char*         buffers = NULL;
+    uring_slot_t* slots   = (uring_slot_t*) calloc(n_slots, sizeof(uring_slot_t));
+    struct iovec* iovs    = (struct iovec*) calloc(n_slots, sizeof(struct iovec));
+    if (!slots || !iovs || posix_memalign((void**) &buffers, URING_ALIGN, n_slots * blk_sz) != 0)
+    {
+        retval = error("%s\n", strerror(ENOMEM));
+        goto finally;
+    }
+
+    for (size_t i = 0; i < n_slots; i++)
+    {
+        iovs[i].iov_base = buffers + i * blk_sz;
+        iovs[i].iov_len  = blk_sz;
+    }
+
+    /* pinned memory may be limited, plain read/write ops work anyway */
+    int is_fixed = syscall(__NR_io_uring_register, ring.ring_fd, IORING_REGISTER_BUFFERS,
+                           iovs, (unsigned) n_slots) == 0;
+
+    off_t  next      = 0;
+    size_t n_active  = 0;
+    int    is_failed = 0;
+
+    for (size_t i = 0; i < n_slots && next < stat_src->st_size; i++)
+    {
+        slots[i].offset = next;
+        slots[i].len    = (size_t) (stat_src->st_size - next) < blk_sz ? (size_t) (stat_src->st_size - next) : blk_sz;
+        next += (off_t) slots[i].len;
+
+        uring_slot_submit(&ring, &slots[i], i, buffers + i * blk_sz, is_fixed, fd_src, fd_dst);
+        n_active++;
+    }
+
+    while (n_active > 0)
+    {
+        if (uring_submit_and_wait(&ring) != 0)
+        {
+            retval = error("io_uring_enter: %s\n", strerror(errno));
+
+            /* the kernel may still write to buffers, see uring_cancel_and_drain() */
+            is_leaked = uring_cancel_and_drain(&ring, n_active, n_slots) != 0;
+            break;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            size_t index = (size_t) cqe->user_data;
+            uring_slot_t* slot = &slots[index];
+            char* buffer = buffers + index * blk_sz;
+
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+            {
+                uring_slot_submit(&ring, slot, index, buffer, is_fixed, fd_src, fd_dst);
+                continue;
+            }
+
+            if (cqe->res <= 0)
+            {
+                if (!is_failed)
+                {
+                    if (cqe->res == 0 && !slot->is_writing)
+                        retval = error("%s: file shrank during copy\n", file_src);
+                    else
+                        retval = error("%s: %s\n", slot->is_writing ? file_dst : file_src,
+                                       strerror(cqe->res ? -cqe->res : EIO));
+                }
+
+                is_failed = 1;
+                n_active--;
+                continue;
+            }
+
+            slot->done += (size_t) cqe->res;
+            if (slot->done < slot->len)
+            {
+                uring_slot_submit(&ring, slot, index, buffer, is_fixed, fd_src, fd_dst);
+                continue;
+            }
+
+            if (!slot->is_writing)
+            {
+                slot->is_writing = 1;
+                slot->done = 0;
+                uring_slot_submit(&ring, slot, index, buffer, is_fixed, fd_src, fd_dst);
+                continue;
+            }
+
+            if (is_failed || next >= stat_src->st_size)
+            {
+                n_active--;
+                continue;
+            }
+
+            slot->offset     = next;
+            slot->len        = (size_t) (stat_src->st_size - next) < blk_sz ? (size_t) (stat_src->st_size - next) : blk_sz;
+            slot->done       = 0;
+            slot->is_writing = 0;
+            next += (off_t) slot->len;
+
+            uring_slot_submit(&ring, slot, index, buffer, is_fixed, fd_src, fd_dst);
+        }
+
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+finally:
+    uring_dtor(&ring);
+
+    if (!is_leaked)
+        free(buffers);
+    free(slots);
+    free(iovs);
+
+    return retval;
+}
+
+static ssize_t
+read_all_at(int fd, char* buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t n_read = pread(fd, buf + done, size - done, offset + (off_t) done);
+        if (n_read == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        if (n_read == 0)
+            break;
+
+        done += (size_t) n_read;
+    }
+
+    return (ssize_t) done;
+}
+
+typedef struct
+{
+    int    fd_src;
+    int    fd_dst;
+    off_t  size;
+    size_t n_chunks;
+
+    atomic_size_t next_chunk;
+    atomic_size_t first_bad;
+} verify_t;
+
+static void*
+verifier_start(void* arg_ptr)
+{
+    verify_t* verify = (verify_t*) arg_ptr;
+
+    char* buf_src = (char*) malloc(RESUME_CHUNK_SZ);
+    char* buf_dst = (char*) malloc(RESUME_CHUNK_SZ);
+
+    size_t chunk = 0;
+    while ((chunk = atomic_fetch_add(&verify->next_chunk, 1)) < verify->n_chunks)
+    {
+        /* everything past the first mismatch is recopied anyway */
+        if (chunk >= atomic_load(&verify->first_bad))
+            break;
+
+        off_t  offset = (off_t) (chunk * RESUME_CHUNK_SZ);
+        size_t len    = (size_t) (verify->size - offset) < RESUME_CHUNK_SZ ? (size_t) (verify->size - offset)
+                                                                           : RESUME_CHUNK_SZ;
+
+        /* both chunks are in memory, so compare them byte for byte */
+        int is_same = buf_src && buf_dst &&
+                      read_all_at(verify->fd_src, buf_src, len, offset) == (ssize_t) len &&
+                      read_all_at(verify->fd_dst, buf_dst, len, offset) == (ssize_t) len &&
+                      memcmp(buf_src, buf_dst, len) == 0;
+        if (is_same)
+            continue;
+
+        size_t first_bad = atomic_load(&verify->first_bad);
+        while (chunk < first_bad &&
+               !atomic_compare_exchange_weak(&verify->first_bad, &first_bad, chunk))
+            ;
+    }
+
+    free(buf_src);
+    free(buf_dst);
+
+    return NULL;
+}
+
+/*
+    Compares chunks of what is already in the destination with the
+    source on -j threads. Returns the number of leading chunks which
+    match and are complete.
+*/
+static size_t
+resume_verify(args_t* args, int fd_src, struct stat* stat_src, int fd_dst)
+{
+    struct stat stat_dst = {};
+    if (fstat(fd_dst, &stat_dst) == -1)
+        return 0;
+
+    verify_t verify = {
+        .fd_src = fd_src,
+        .fd_dst = fd_dst,
+        .size   = stat_dst.st_size < stat_src->st_size ? stat_dst.st_size : stat_src->st_size,
+    };
+
+    /* partial tail chunk is rewritten rather than checked */
+    verify.n_chunks = (size_t) verify.size / RESUME_CHUNK_SZ;
+    if (verify.size == stat_src->st_size && (size_t) verify.size % RESUME_CHUNK_SZ)
+        verify.n_chunks++;
+
+    atomic_init(&verify.next_chunk, 0);
+    atomic_init(&verify.first_bad, verify.n_chunks);
+
+    size_t n_threads = (size_t) args->n_jobs;
+    pthread_t* tids = (pthread_t*) calloc(n_threads, sizeof(pthread_t));
+
+    size_t n_started = 0;
+    while (tids && n_started < n_threads &&
+           pthread_create(&tids[n_started], NULL, verifier_start, &verify) == 0)
+    {
+        n_started++;
+    }
+
+    if (n_started == 0)
+        verifier_start(&verify);
+
+    for (size_t i = 0; i < n_started; i++)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+
+    return atomic_load(&verify.first_bad);
+}
+
+/*
+    Marks chunks listed in the journal as done. Journal of another
+    version of the source is ignored.
+*/
+static int
+journal_load(char* journal_path, struct stat* stat_src, char* is_done, size_t n_chunks)
+{
+    int fd = open(journal_path, O_RDONLY);
+    if (fd == -1)
+        return 1;
+
+    journal_header_t header = {};
+    if (read_all_at(fd, (char*) &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 ||
+        header.src_size != (uint64_t) stat_src->st_size ||
+        header.src_mtime_sec != stat_src->st_mtim.tv_sec ||
+        header.src_mtime_nsec != stat_src->st_mtim.tv_nsec ||
+        header.chunk_sz != RESUME_CHUNK_SZ)
+    {
+        close(fd);
+        return 1;
+    }
+
+    uint64_t chunk = 0;
+    off_t offset = (off_t) sizeof(header);
+    while (read_all_at(fd, (char*) &chunk, sizeof(chunk), offset) == (ssize_t) sizeof(chunk))
+    {
+        if (chunk < n_chunks)
+            is_done[chunk] = 1;
+
+        offset += (off_t) sizeof(chunk);
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+static int
+journal_append(int fd, const uint64_t* chunks, size_t n_chunks)
+{
+    return write_all(fd, (const char*) chunks, n_chunks * sizeof(uint64_t));
+}
+
+/*
+    --resume / --journal copy. The destination is not truncated; chunks
+    known to be done, from the journal or from verification against src,
+    are skipped, the rest is copied with pread/pwrite. With --journal
+    every JOURNAL_BATCH chunks the destination is fdatasync'ed and only
+    then their indices are appended to <dst>.cpjournal, so the journal
+    never claims data which could be lost. The journal is removed once
+    the copy is complete.
+*/
+static int
+copy_resume(args_t* args,
+            char* file_src, int fd_src, struct stat* stat_src,
+            char* file_dst, int fd_dst)
+{
+    size_t n_chunks = ((size_t) stat_src->st_size + RESUME_CHUNK_SZ - 1) / RESUME_CHUNK_SZ;
+
+    int retval = 0;
+    int fd_journal = -1;
+
+    size_t    n_pending = 0;
+    uint64_t* pending   = (uint64_t*) malloc(JOURNAL_BATCH * sizeof(uint64_t));
+
+    char* buffer       = (char*) malloc(RESUME_CHUNK_SZ);
+    char* is_done      = (char*) calloc(n_chunks + 1, sizeof(char));
+    char* journal_path = (char*) malloc(strlen(file_dst) + sizeof(JOURNAL_SUFFIX));
+    if (!pending || !buffer || !is_done || !journal_path)
+    {
+        retval = error("%s\n", strerror(ENOMEM));
+        goto finally;
+    }
+
+    strcpy(journal_path, file_dst);
+    strcat(journal_path, JOURNAL_SUFFIX);
+
+    int has_journal = args->is_resume &&
+                      journal_load(journal_path, stat_src, is_done, n_chunks) == 0;
+
+    if (has_journal && args->is_verbose)
+        fprintf(stderr, "resuming '%s' from %s\n", file_dst, journal_path);
+
+    if (args->is_resume && !has_journal)
+    {
+        size_t n_good = resume_verify(args, fd_src, stat_src, fd_dst);
+        memset(is_done, 1, n_good);
+
+        if (args->is_verbose)
+            fprintf(stderr, "resuming '%s' at %zu of %zu chunks\n", file_dst, n_good, n_chunks);
+    }
+
+    if (args->is_journal)
+    {
+        fd_journal = open(journal_path, O_WRONLY | O_CREAT | (has_journal ? O_APPEND : O_TRUNC), 0644);
+        if (fd_journal == -1)
+        {
+            retval = error("%s: %s\n", journal_path, strerror(errno));
+            goto finally;
+        }
+
+        if (!has_journal)
+        {
+            journal_header_t header = {
+                .src_size       = (uint64_t) stat_src->st_size,
+                .src_mtime_sec  = stat_src->st_mtim.tv_sec,
+                .src_mtime_nsec = stat_src->st_mtim.tv_nsec,
+                .chunk_sz       = RESUME_CHUNK_SZ,
+            };
+            memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+
+            if (write_all(fd_journal, (const char*) &header, sizeof(header)) != 0)
+            {
+                retval = error("%s: %s\n", journal_path, strerror(errno));
+                goto finally;
+            }
+
+            /* verified chunks may be only in the page cache, sync them first */
+            if (is_done[0] && fdatasync(fd_dst) == -1)
+            {
+                retval = error("%s: %s\n", file_dst, strerror(errno));
+                goto finally;
+            }
+
+            for (size_t chunk = 0; chunk < n_chunks && is_done[chunk]; chunk++)
+            {
+                uint64_t record = chunk;
+                if (journal_append(fd_journal, &record, 1) != 0)
+                {
+                    retval = error("%s: %s\n", journal_path, strerror(errno));
+                    goto finally;
+                }
+            }
+        }
+    }
+
+    for (size_t chunk = 0; chunk < n_chunks; chunk++)
+    {
+        if (is_done[chunk])
+            continue;
+
+        off_t  offset = (off_t) (chunk * RESUME_CHUNK_SZ);
+        size_t len    = (size_t) (stat_src->st_size - offset) < RESUME_CHUNK_SZ ? (size_t) (stat_src->st_size - offset)
+                                                                              : RESUME_CHUNK_SZ;
+
+        ssize_t n_read = read_all_at(fd_src, buffer, len, offset);
+        if (n_read != (ssize_t) len)
+        {
+            retval = n_read == -1 ? error("%s: %s\n", file_src, strerror(errno))
+                                  : error("%s: file shrank during copy\n", file_src);
+            goto finally;
+        }
+
+        if (write_all_at(fd_dst, buffer, len, offset) != 0)
+        {
+            retval = error("%s: %s\n", file_dst, strerror(errno));
+            goto finally;
+        }
+
+        if (fd_journal == -1)
+            continue;
+
+        pending[n_pending++] = chunk;
+        if (n_pending == JOURNAL_BATCH || chunk + 1 == n_chunks)
+        {
+            if (fdatasync(fd_dst) == -1 || journal_append(fd_journal, pending, n_pending) != 0)
+            {
+                retval = error("%s: %s\n", journal_path, strerror(errno));
+                goto finally;
+            }
+
+            n_pending = 0;
+        }
+    }
+
+    if (ftruncate(fd_dst, stat_src->st_size) == -1)
+    {
+        retval = error("%s: %s\n", file_dst, strerror(errno));
+        goto finally;
+    }
+
+    if ((fd_journal != -1 || has_journal) && unlink(journal_path) == -1)
+        retval = error("%s: %s\n", journal_path, strerror(errno));
+
+finally:
+    if (fd_journal != -1)
+        close(fd_journal);
+
+    free(pending);
+    free(buffer);
+    free(is_done);
+    free(journal_path);
+
+    return retval;
+}
+
+/*
+    Copies with the engine chosen by -e. In auto mode tries reflink,
+    then copy_file_range, then io_uring for files bigger than one
+    block, then the read/write loop. --resume and --journal copies go
+    through copy_resume() regardless of the engine, --direct (or -e
+    direct) ones not reflinked go through copy_direct(). Sparse sources
+    (or any source with --sparse=always) that are not reflinked go through
+    copy_sparse(); --sparse=never writes out every byte, so only mmap
+    and read/write engines are used. Engine which did the job is stored
+    to `used`, `is_sparse` tells if holes were preserved by hand.
+*/
+static int
+copy_data(args_t* args,
+          char* file_src, int fd_src, struct stat* stat_src,
+          char* file_dst, int fd_dst, engine_t* used, int* is_sparse)
+{
+    int retval  = -1;
+    int is_auto = args->engine == ENGINE_AUTO;
+    int is_reg  = S_ISREG(stat_src->st_mode);
+    int is_keep = args->sparse != SPARSE_NEVER;
+
+    if (is_reg && (args->is_resume || args->is_journal))
+    {
+        *used = ENGINE_RW;
+        return copy_resume(args, file_src, fd_src, stat_src, file_dst, fd_dst);
+    }
+
+    if (is_reg && is_keep && (is_auto || args->engine == ENGINE_REFLINK))
+    {
+        *used = ENGINE_REFLINK;
+        retval = copy_reflink(fd_src, file_dst, fd_dst);
+        if (retval == -1 && !is_auto)
+            return error("failed to clone '%s' from '%s': %s\n", file_dst, file_src, strerror(errno));
+
+        if (retval != -1)
+            return retval;
+    }
+
+    /* st_blocks is counted in 512-byte units */
+    int is_holey = args->sparse == SPARSE_ALWAYS ||
+                   (args->sparse == SPARSE_AUTO && stat_src->st_blocks * 512 < stat_src->st_size);
+
+    if (is_reg && (args->is_direct || args->engine == ENGINE_DIRECT))
+    {
+        *used = ENGINE_DIRECT;
+        *is_sparse = is_holey;
+        return copy_direct(file_src, fd_src, stat_src, file_dst, fd_dst, is_holey);
+    }
+
+    if (is_reg && is_holey)
+    {
+        *is_sparse = 1;
+        return copy_sparse(args, file_src, fd_src, stat_src, file_dst, fd_dst, used);
+    }
+
+    if (is_reg && is_keep && (is_auto || args->engine == ENGINE_RANGE))
+    {
+        *used = ENGINE_RANGE;
+        retval = copy_range(file_src, fd_src, stat_src, file_dst, fd_dst);
+        if (retval != -1)
+            return retval;
+    }
+
+    if (is_reg && args->engine == ENGINE_MMAP && stat_src->st_size > 0)
+    {
+        *used = ENGINE_MMAP;
+        retval = copy_mmap(file_src, fd_src, stat_src, file_dst, fd_dst);
+        if (retval != -1)
+            return retval;
+    }
+
+    if (is_reg && ((is_auto && (size_t) stat_src->st_size > args->block_size) ||
+                   (args->engine == ENGINE_URING && stat_src->st_size > 0)))
+    {
+        *used = ENGINE_URING;
+        retval = copy_uring(args, file_src, fd_src, stat_src, file_dst, fd_dst);
+        if (retval != -1)
+            return retval;
+    }
+
+    *used = ENGINE_RW;
+    return copy_rw(file_src, fd_src, stat_src, file_dst, fd_dst);
+}
+
+static int
+copy_file(args_t* args,
+          char* file_src, struct stat* stat_src,
+          char* file_dst, struct stat* stat_dst)
+{
+    int fd_src = -1;
+    int fd_dst = -1;
+    engine_t used = ENGINE_RW;
+    int is_sparse = 0;
+
+    int retval = 0;
+
+    if (S_ISDIR(stat_src->st_mode))
+        return error("%s: %s\n", file_src, strerror(EISDIR));
+
+    if (stat_dst &&
+        stat_dst->st_dev == stat_src->st_dev &&
+        stat_dst->st_ino == stat_src->st_ino)
+    {
+        return error("'%s' and '%s' are the same file\n", file_src, file_dst);
+    }
+
+    if (stat_dst)
+    {
+        if (!is_overwrite(args, file_dst))
+            return 0;
+        
+        if (args->is_force && !args->is_resume)
+            if(unlink(file_dst) == -1)
+                return error("cannot remove '%s': %s", file_dst, strerror(errno));
+    }
+
+    fd_src = open(file_src, O_RDONLY);
+    if (fd_src == -1)
+    {
+        retval = error("%s: %s\n", file_src, strerror(errno));
+
+        goto finally;
+    }
+
+    /* resumed destination is kept and read back for verification */
+    if (args->is_resume)
+        fd_dst = open(file_dst, O_RDWR | O_CREAT, stat_src->st_mode);
+    else
+        fd_dst = open(file_dst, O_WRONLY | O_CREAT | O_TRUNC, stat_src->st_mode);
+    if (fd_dst == -1)
+    {
+        retval = error("%s: %s\n", file_dst, strerror(errno));
+
+        goto finally;
+    }
+
+    retval = copy_data(args, file_src, fd_src, stat_src, file_dst, fd_dst, &used, &is_sparse);
+
+    /* recursive copies keep mode and times of every file */
+    if (retval == 0 && args->is_recursive)
+        retval = preserve_metadata(file_dst, fd_dst, stat_src);
+
+finally:
+
+    if (fd_src != -1)
+        close(fd_src);
+
+    if (fd_dst != -1)
+        close(fd_dst);
+
+    if (args->is_verbose && retval == 0)
+        fprintf(stderr, "'%s' -> '%s' (%s%s)\n", file_src, file_dst,
+                ENGINE_NAMES[used], is_sparse ? ", sparse" : "");
+
+    return retval;
+}
+
+/******************************************************************************/
+
+typedef enum
+{
+    TASK_FILE,
+    TASK_DIR,
+} task_kind_t;
+
+/*
+    Directory task stays alive until all its children are done:
+    n_pending counts them plus one for the scan of the directory itself.
+    Its metadata is set once the last child finishes, so copying into it
+    does not clobber the times.
+*/
+typedef struct task
+{
+    task_kind_t  kind;
+    char*        src;
+    char*        dst;
+    struct stat  stat_src;
+    struct task* parent;
+
+    atomic_size_t n_pending;
+    int           is_created;
+} task_t;
+
+/*
+    Work-stealing deque: owner pushes and pops at the bottom (depth
+    first, keeps few tasks alive), thieves take from the top, where the
+    biggest subtrees are.
+*/
+typedef struct
+{
+    pthread_mutex_t mutex;
+
+    task_t** tasks;
+    size_t   head;
+    size_t   size;
+    size_t   cap;
+} deque_t;
+
+typedef struct
+{
+    args_t* args;
+
+    deque_t*   deques;
+    pthread_t* tids;
+    size_t     n_workers;
+
+    /* destination root, skipped when met inside the source tree */
+    dev_t root_dev;
+    ino_t root_ino;
+
+    atomic_size_t n_queued;
+    atomic_size_t n_outstanding;
+    atomic_size_t n_sleeping;
+    atomic_int    retval;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  has_work;
+
+    pthread_mutex_t budget_mutex;
+    pthread_cond_t  budget_free;
+    size_t          budget_used;
+} pool_t;
+
+typedef struct
+{
+    pool_t* pool;
+    size_t  index;
+} worker_t;
+
+static int
+deque_push(deque_t* deque, task_t* task)
+{
+    pthread_mutex_lock(&deque->mutex);
+
+    if (deque->size == deque->cap)
+    {
+        size_t new_cap = deque->cap ? 2 * deque->cap : DEQUE_INIT_CAP;
+        task_t** tmp = (task_t**) malloc(new_cap * sizeof(task_t*));
+        if (!tmp)
+        {
+            pthread_mutex_unlock(&deque->mutex);
+            return 1;
+        }
+
+        for (size_t i = 0; i < deque->size; i++)
+            tmp[i] = deque->tasks[(deque->head + i) % deque->cap];
+
+        free(deque->tasks);
+        deque->tasks = tmp;
+        deque->head  = 0;
+        deque->cap   = new_cap;
+    }
+
+    deque->tasks[(deque->head + deque->size) % deque->cap] = task;
+    deque->size++;
+
+    pthread_mutex_unlock(&deque->mutex);
+
+    return 0;
+}
+
+static task_t*
+deque_pop(deque_t* deque)
+{
+    task_t* task = NULL;
+
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->size > 0)
+    {
+        deque->size--;
+        task = deque->tasks[(deque->head + deque->size) % deque->cap];
+    }
+    pthread_mutex_unlock(&deque->mutex);
+
+    return task;
+}
+
+static task_t*
+deque_steal(deque_t* deque)
+{
+    task_t* task = NULL;
+
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->size > 0)
+    {
+        task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->cap;
+        deque->size--;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+
+    return task;
+}
+
+static char*
+path_join(const char* dir, const char* name)
+{
+    size_t dir_sz  = strlen(dir);
+    size_t name_sz = strlen(name);
+
+    char* path = (char*) malloc(dir_sz + 1 + name_sz + 1);
+    if (!path)
+        return NULL;
+
+    memcpy(path, dir, dir_sz);
+    path[dir_sz] = '/';
+    memcpy(path + dir_sz + 1, name, name_sz + 1);
+
+    return path;
+}
+
+static task_t*
+task_new(task_kind_t kind, char* src, char* dst, struct stat* stat_src, task_t* parent)
+{
+    task_t* task = (task_t*) calloc(1, sizeof(task_t));
+    if (!task)
+        return NULL;
+
+    task->kind     = kind;
+    task->src      = src;
+    task->dst      = dst;
+    task->stat_src = *stat_src;
+    task->parent   = parent;
+
+    atomic_init(&task->n_pending, 1);
+
+    return task;
+}
+
+static void
+pool_wake(pool_t* pool, int is_all)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    if (is_all)
+        pthread_cond_broadcast(&pool->has_work);
+    else
+        pthread_cond_signal(&pool->has_work);
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+    Drops task and walks up finishing every directory whose last child
+    it was.
+*/
+static void
+task_finish(pool_t* pool, task_t* task)
+{
+    while (task)
+    {
+        if (atomic_fetch_sub(&task->n_pending, 1) != 1)
+            return;
+
+        task_t* parent = task->parent;
+
+        if (task->kind == TASK_DIR && task->is_created &&
+            preserve_metadata(task->dst, -1, &task->stat_src) != 0)
+        {
+            atomic_store(&pool->retval, 1);
+        }
+
+        free(task->src);
+        free(task->dst);
+        free(task);
+
+        if (atomic_fetch_sub(&pool->n_outstanding, 1) == 1)
+            pool_wake(pool, 1);
+
+        task = parent;
+    }
+}
+
+static void
+pool_push(pool_t* pool, size_t index, task_t* task)
+{
+    atomic_fetch_add(&pool->n_outstanding, 1);
+    if (task->parent)
+        atomic_fetch_add(&task->parent->n_pending, 1);
+
+    if (deque_push(&pool->deques[index], task) != 0)
+    {
+        error("%s: %s\n", task->src, strerror(ENOMEM));
+        atomic_store(&pool->retval, 1);
+        task_finish(pool, task);
+
+        return;
+    }
+
+    atomic_fetch_add(&pool->n_queued, 1);
+    if (atomic_load(&pool->n_sleeping) > 0)
+        pool_wake(pool, 0);
+}
+
+/*
+    Own deque first, then steal round-robin. Sleeps while there is
+    nothing queued; NULL means the whole tree is done.
+*/
+static task_t*
+pool_get(pool_t* pool, size_t index)
+{
+    while (1)
+    {
+        task_t* task = deque_pop(&pool->deques[index]);
+
+        for (size_t i = 1; !task && i < pool->n_workers; i++)
+            task = deque_steal(&pool->deques[(index + i) % pool->n_workers]);
+
+        if (task)
+        {
+            atomic_fetch_sub(&pool->n_queued, 1);
+            return task;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        atomic_fetch_add(&pool->n_sleeping, 1);
+
+        while (atomic_load(&pool->n_queued) == 0 && atomic_load(&pool->n_outstanding) > 0)
+            pthread_cond_wait(&pool->has_work, &pool->mutex);
+
+        atomic_fetch_sub(&pool->n_sleeping, 1);
+        int is_done = atomic_load(&pool->n_outstanding) == 0;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (is_done)
+            return NULL;
+    }
+}
+
+static size_t
+budget_acquire(pool_t* pool, off_t size)
+{
+    size_t want = (size_t) size;
+    if (want > pool->args->inflight)
+        want = pool->args->inflight;
+
+    pthread_mutex_lock(&pool->budget_mutex);
+
+    while (pool->budget_used > 0 && pool->budget_used + want > pool->args->inflight)
+        pthread_cond_wait(&pool->budget_free, &pool->budget_mutex);
+
+    pool->budget_used += want;
+    pthread_mutex_unlock(&pool->budget_mutex);
+
+    return want;
+}
+
+static void
+budget_release(pool_t* pool, size_t size)
+{
+    pthread_mutex_lock(&pool->budget_mutex);
+    pool->budget_used -= size;
+    pthread_cond_broadcast(&pool->budget_free);
+    pthread_mutex_unlock(&pool->budget_mutex);
+}
+
+static int
+copy_symlink(args_t* args, task_t* task)
+{
+    size_t target_sz = (size_t) task->stat_src.st_size + 1;
+    char* target = (char*) malloc(target_sz);
+    if (!target)
+        return error("%s\n", strerror(errno));
+
+    ssize_t n_read = readlink(task->src, target, target_sz);
+    if (n_read == -1 || (size_t) n_read == target_sz)
+    {
+        free(target);
+        return error("%s: cannot read link: %s\n", task->src, strerror(n_read == -1 ? errno : ENAMETOOLONG));
+    }
+    target[n_read] = '\0';
+
+    int retval = 0;
+    if (symlink(target, task->dst) == -1)
+        retval = error("%s: cannot create symlink: %s\n", task->dst, strerror(errno));
+
+    free(target);
+
+    if (retval == 0 && args->is_verbose)
+        fprintf(stderr, "'%s' -> '%s'\n", task->src, task->dst);
+
+    return retval;
+}
+
+static void
+run_file(pool_t* pool, task_t* task)
+{
+    struct stat  stat_dst = {};
+    struct stat* stat_ptr = &stat_dst;
+    if (lstat(task->dst, &stat_dst) == -1)
+    {
+        if (errno != ENOENT)
+        {
+            error("%s: %s\n", task->dst, strerror(errno));
+            atomic_store(&pool->retval, 1);
+
+            return;
+        }
+
+        stat_ptr = NULL;
+    }
+
+    size_t budget = budget_acquire(pool, task->stat_src.st_size);
+
+    if (copy_file(pool->args, task->src, &task->stat_src, task->dst, stat_ptr) != 0)
+        atomic_store(&pool->retval, 1);
+
+    budget_release(pool, budget);
+}
+
+/*
+    Creates destination directory and queues its entries. Children are
+    queued only after mkdir, so no file is ever copied into a directory
+    that does not exist yet.
+*/
+static void
+run_dir(pool_t* pool, size_t index, task_t* task)
+{
+    if (mkdir(task->dst, (task->stat_src.st_mode & 07777) | S_IRWXU) == -1)
+    {
+        struct stat stat_dst = {};
+        if (errno != EEXIST || stat(task->dst, &stat_dst) == -1 || !S_ISDIR(stat_dst.st_mode))
+        {
+            error("cannot create directory '%s': %s\n", task->dst, strerror(errno == EEXIST ? ENOTDIR : errno));
+            atomic_store(&pool->retval, 1);
+
+            return;
+        }
+    }
+    task->is_created = 1;
+
+    if (pool->args->is_verbose)
+        fprintf(stderr, "'%s' -> '%s'\n", task->src, task->dst);
+
+    DIR* dir = opendir(task->src);
+    if (!dir)
+    {
+        error("%s: %s\n", task->src, strerror(errno));
+        atomic_store(&pool->retval, 1);
+
+        return;
+    }
+
+    struct dirent* entry = NULL;
+    while ((errno = 0, entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char* src = path_join(task->src, entry->d_name);
+        char* dst = path_join(task->dst, entry->d_name);
+        if (!src || !dst)
+        {
+            free(src);
+            free(dst);
+            error("%s\n", strerror(ENOMEM));
+            atomic_store(&pool->retval, 1);
+
+            break;
+        }
+
+        struct stat stat_src = {};
+        if (fstatat(dirfd(dir), entry->d_name, &stat_src, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+            error("%s: %s\n", src, strerror(errno));
+            atomic_store(&pool->retval, 1);
+            free(src);
+            free(dst);
+
+            continue;
+        }
+
+        if (stat_src.st_dev == pool->root_dev && stat_src.st_ino == pool->root_ino)
+        {
+            error("cannot copy a directory, '%s', into itself\n", src);
+            atomic_store(&pool->retval, 1);
+            free(src);
+            free(dst);
+
+            continue;
+        }
+
+        task_kind_t kind = TASK_FILE;
+        if (S_ISDIR(stat_src.st_mode))
+        {
+            kind = TASK_DIR;
+        }
+        else if (!S_ISREG(stat_src.st_mode))
+        {
+            task_t link = {.src = src, .dst = dst, .stat_src = stat_src};
+            if (!S_ISLNK(stat_src.st_mode))
+                error("'%s': cannot copy special file\n", src);
+
+            if (!S_ISLNK(stat_src.st_mode) || copy_symlink(pool->args, &link) != 0)
+                atomic_store(&pool->retval, 1);
+
+            free(src);
+            free(dst);
+
+            continue;
+        }
+
+        task_t* child = task_new(kind, src, dst, &stat_src, task);
+        if (!child)
+        {
+            free(src);
+            free(dst);
+            error("%s\n", strerror(ENOMEM));
+            atomic_store(&pool->retval, 1);
+
+            break;
+        }
+
+        pool_push(pool, index, child);
+    }
+
+    if (errno)
+    {
+        error("%s: %s\n", task->src, strerror(errno));
+        atomic_store(&pool->retval, 1);
+    }
+
+    closedir(dir);
+}
+
+static void*
+copier_start(void* arg_ptr)
+{
+    worker_t* worker = (worker_t*) arg_ptr;
+    pool_t*   pool   = worker->pool;
+
+    task_t* task = NULL;
+    while ((task = pool_get(pool, worker->index)) != NULL)
+    {
+        if (task->kind == TASK_DIR)
+            run_dir(pool, worker->index, task);
+        else
+            run_file(pool, task);
+
+        task_finish(pool, task);
+    }
+
+    return NULL;
+}
+
+/*
+    Copies directory tree with -j copier threads. Errors do not stop
+    the walk, the rest of the tree is still copied.
+*/
+static int
+copy_tree(args_t* args, char* dir_src, struct stat* stat_src, char* dir_dst)
+{
+    pool_t pool = {.args = args};
+    worker_t* workers = NULL;
+
+    char* src = strdup(dir_src);
+    char* dst = strdup(dir_dst);
+    task_t* root = (src && dst) ? task_new(TASK_DIR, src, dst, stat_src, NULL) : NULL;
+    if (!root)
+    {
+        free(src);
+        free(dst);
+
+        return error("%s\n", strerror(ENOMEM));
+    }
+
+    pool.n_workers = (size_t) args->n_jobs;
+    pool.deques = (deque_t*) calloc(pool.n_workers, sizeof(deque_t));
+    pool.tids   = (pthread_t*) calloc(pool.n_workers, sizeof(pthread_t));
+    workers     = (worker_t*) calloc(pool.n_workers, sizeof(worker_t));
+    if (!pool.deques || !pool.tids || !workers)
+    {
+        free(pool.deques);
+        free(pool.tids);
+        free(workers);
+        free(root->src);
+        free(root->dst);
+        free(root);
+
+        return error("%s\n", strerror(ENOMEM));
+    }
+
+    for (size_t i = 0; i < pool.n_workers; i++)
+        pthread_mutex_init(&pool.deques[i].mutex, NULL);
+
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.has_work, NULL);
+    pthread_mutex_init(&pool.budget_mutex, NULL);
+    pthread_cond_init(&pool.budget_free, NULL);
+
+    atomic_init(&pool.n_queued, 0);
+    atomic_init(&pool.n_outstanding, 0);
+    atomic_init(&pool.n_sleeping, 0);
+    atomic_init(&pool.retval, 0);
+
+    /* root is created up front to know what to skip inside the source */
+    struct stat stat_root = {};
+    if (mkdir(dir_dst, (stat_src->st_mode & 07777) | S_IRWXU) == -1 && errno != EEXIST)
+        atomic_store(&pool.retval, error("cannot create directory '%s': %s\n", dir_dst, strerror(errno)));
+    else if (stat(dir_dst, &stat_root) == -1)
+        atomic_store(&pool.retval, error("%s: %s\n", dir_dst, strerror(errno)));
+
+    if (atomic_load(&pool.retval) == 0)
+    {
+        pool.root_dev = stat_root.st_dev;
+        pool.root_ino = stat_root.st_ino;
+
+        pool_push(&pool, 0, root);
+
+        size_t n_started = 0;
+        for (; n_started < pool.n_workers; n_started++)
+        {
+            workers[n_started].pool  = &pool;
+            workers[n_started].index = n_started;
+
+            int err = pthread_create(&pool.tids[n_started], NULL, copier_start, &workers[n_started]);
+            if (err != 0)
+            {
+                /* tasks of missing workers are stolen by the others */
+                if (n_started == 0)
+                    copier_start(&workers[0]);
+
+                break;
+            }
+        }
+
+        for (size_t i = 0; i < n_started; i++)
+            pthread_join(pool.tids[i], NULL);
+    }
+    else
+    {
+        free(root->src);
+        free(root->dst);
+        free(root);
+    }
+
+    for (size_t i = 0; i < pool.n_workers; i++)
+    {
+        pthread_mutex_destroy(&pool.deques[i].mutex);
+        free(pool.deques[i].tasks);
+    }
+
+    pthread_cond_destroy(&pool.budget_free);
+    pthread_mutex_destroy(&pool.budget_mutex);
+    pthread_cond_destroy(&pool.has_work);
+    pthread_mutex_destroy(&pool.mutex);
+
+    free(pool.deques);
+    free(pool.tids);
+    free(workers);
+
+    return atomic_load(&pool.retval);
+}
+
+/******************************************************************************/
+
+/*
+    Directories are copied recursively with -r, everything else goes to
+    copy_file().
+*/
+static int
+copy_entry(args_t* args,
+           char* file_src, struct stat* stat_src,
+           char* file_dst, struct stat* stat_dst)
+{
+    if (args->is_recursive && S_ISDIR(stat_src->st_mode))
+    {
+        if (stat_dst && !S_ISDIR(stat_dst->st_mode))
+            return error("cannot overwrite non-directory '%s' with directory '%s'\n", file_dst, file_src);
+
+        return copy_tree(args, file_src, stat_src, file_dst);
+    }
+
+    return copy_file(args, file_src, stat_src, file_dst, stat_dst);
+}
+
 static int
 copy_to_newfile(args_t* args)
 {
@@ -230,7 +2318,7 @@ copy_to_newfile(args_t* args)
     if (stat(args->src_arr[0], &stat_src) == -1)
         return error("%s: %s\n", args->src_arr[0], strerror(errno));
 
-    return copy_file(args, args->src_arr[0], &stat_src, args->dst, NULL);
+    return copy_entry(args, args->src_arr[0], &stat_src, args->dst, NULL);
 }
 
 static int
@@ -240,7 +2328,7 @@ copy_to_file(args_t* args, struct stat* stat_dst)
     if (stat(args->src_arr[0], &stat_src) == -1)
         return error("%s: %s\n", args->src_arr[0], strerror(errno));
 
-    return copy_file(args, args->src_arr[0], &stat_src, args->dst, stat_dst);
+    return copy_entry(args, args->src_arr[0], &stat_src, args->dst, stat_dst);
 }
 
 static int
@@ -318,7 +2406,7 @@ copy_to_dir(args_t* args)
             stat_ptr = NULL;
         }
 
-        retval = copy_file(args, args->src_arr[i], &stat_src, namebuf, stat_ptr);
+        retval = copy_entry(args, args->src_arr[i], &stat_src, namebuf, stat_ptr);
     }
 
     free(namebuf);
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Pipe-to-pipe throughput of threadcat with the lock-free ring against
+# the mutex/condvar one (threadcat-mutex, see make mutex), then of the
+# copying and zero-copy (-z) modes with 64K chunks, then of reader and
+# writer placed on neighbouring and on distant CPUs (-C).
+# usage: ./bench.sh [size_MiB] [runs]
+#
+
+SIZE_MB=${1:-256}
+RUNS=${2:-5}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+SRC="$DIR/src"
+
+head -c "${SIZE_MB}M" /dev/urandom > "$SRC"
+
+. "$(dirname "$0")/../benchlib.sh"
+
+# Pipe in, count what comes out
+relay()
+{
+    n_bytes=$(cat "$SRC" | "$@" | wc -c)
+    if [ "$n_bytes" -ne $(( SIZE_MB * 1048576 )) ]
+    then
+        echo "$*: $n_bytes bytes written" >&2
+        return 1
+    fi
+}
+
+bench()
+{
+    best_of "$*" relay "$@"
+}
+
+bench ./threadcat-mutex
+bench ./threadcat
+bench ./threadcat -b 64K
+bench ./threadcat -b 64K -z
+bench ./threadcat -b 64K -C compact
+bench ./threadcat -b 64K -C scatter
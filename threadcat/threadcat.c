@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,6 +10,14 @@
 #include <errno.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <stdalign.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #ifdef DEBUG
     #define $DBG(FMT, ...) fprintf(stderr, "%s: " FMT "\n", __PRETTY_FUNCTION__, ##__VA_ARGS__)
@@ -20,8 +29,33 @@ typedef struct
 {
     int    n_files;
     char** files_arr;
+
+    size_t chunk_sz;
+    size_t n_chunks;
+    int    is_adaptive;
+    int    is_splice;
+    int    n_readers;
+    int    is_stats;
+
+    const char* affinity;
 } Args;
 
+/* Ring geometry unless -b and -n are given */
+static const size_t CHUNK_SZ = 256;
+static const size_t N_CHUNKS = 16;
+
+/*
+    Adaptive mode (-a) starts every input with the smallest chunk and
+    doubles it while the writer keeps up, up to st_blksize of a file or
+    capacity of a pipe. Slots are allocated for ADAPTIVE_MAX_CHUNK_SZ
+    bytes when -b is not given.
+*/
+static const size_t ADAPTIVE_MIN_CHUNK_SZ = 256;
+static const size_t ADAPTIVE_MAX_CHUNK_SZ = 1 << 16;
+
+/* Stack buffer of splice fallbacks */
+#define SPLICE_FALLBACK_SZ 4096
+
 const char* PROGNAME = NULL;
 
 static int
@@ -37,18 +71,306 @@ error(char* fmt, ...)
 	return 1;
 }
 
+/*
+    Thread placement. compact fills the hardware threads of a core, then
+    the cores of a package before moving to the next one; scatter takes
+    one hardware thread of every core, alternating packages, before
+    doubling up; a list such as 0,2,8-11 is used as given. Only CPUs of
+    the process affinity mask are placed on. Thread i runs on
+    cpus[i % n_cpus] from its start, so the memory it touches first is
+    allocated on its node.
+*/
+typedef struct
+{
+    const char* policy;
+    int*        cpus;
+    size_t      n_cpus;
+} CpuPlacement;
+
+typedef struct
+{
+    int cpu;
+    int package;
+    int core;
+    int sibling;    /* rank among the hardware threads of the core */
+} CpuTopology;
+
 static int
-parseArgs(int argc, char* argv[], Args* args)
+readTopology(int cpu, const char* name)
+{
+    char path[128] = {};
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+
+    int value = 0;
+    FILE* file = fopen(path, "r");
+    if (file)
+    {
+        if (fscanf(file, "%d", &value) != 1)
+            value = 0;
+
+        fclose(file);
+    }
+
+    return value;
+}
+
+static int
+compareInt(int arg1, int arg2)
+{
+    if (arg1 < arg2) return -1;
+    if (arg1 > arg2) return 1;
+    return 0;
+}
+
+static int
+compareCompact(const void* a, const void* b)
+{
+    const CpuTopology* arg1 = (const CpuTopology*) a;
+    const CpuTopology* arg2 = (const CpuTopology*) b;
+
+    if (arg1->package != arg2->package) return compareInt(arg1->package, arg2->package);
+    if (arg1->core    != arg2->core)    return compareInt(arg1->core,    arg2->core);
+    return compareInt(arg1->cpu, arg2->cpu);
+}
+
+static int
+compareScatter(const void* a, const void* b)
+{
+    const CpuTopology* arg1 = (const CpuTopology*) a;
+    const CpuTopology* arg2 = (const CpuTopology*) b;
+
+    if (arg1->sibling != arg2->sibling) return compareInt(arg1->sibling, arg2->sibling);
+    if (arg1->core    != arg2->core)    return compareInt(arg1->core,    arg2->core);
+    if (arg1->package != arg2->package) return compareInt(arg1->package, arg2->package);
+    return compareInt(arg1->cpu, arg2->cpu);
+}
+
+static int
+cpuPlacementCtor(CpuPlacement* placement, const char* policy)
+{
+    cpu_set_t allowed = {};
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return error("cannot get affinity: %s\n", strerror(errno));
+
+    placement->policy = policy;
+    placement->n_cpus = 0;
+    placement->cpus   = (int*) calloc(CPU_SETSIZE, sizeof(int));
+    if (!placement->cpus)
+        return error("cannot allocate memory\n");
+
+    int is_compact = strcmp(policy, "compact") == 0;
+    if (is_compact || strcmp(policy, "scatter") == 0)
+    {
+        CpuTopology* topology = (CpuTopology*) calloc(CPU_SETSIZE, sizeof(CpuTopology));
+        if (!topology)
+            return error("cannot allocate memory\n");
+
+        size_t n_cpus = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (!CPU_ISSET((size_t) cpu, &allowed))
+                continue;
+
+            CpuTopology* info = &topology[n_cpus];
+            *info = (CpuTopology) {
+                .cpu     = cpu,
+                .package = readTopology(cpu, "physical_package_id"),
+                .core    = readTopology(cpu, "core_id")
+            };
+
+            for (size_t i = 0; i < n_cpus; i++)
+            {
+                if (topology[i].package == info->package && topology[i].core == info->core)
+                    info->sibling++;
+            }
+
+            n_cpus++;
+        }
+
+        qsort(topology, n_cpus, sizeof(CpuTopology), is_compact ? compareCompact : compareScatter);
+
+        for (size_t i = 0; i < n_cpus; i++)
+            placement->cpus[i] = topology[i].cpu;
+
+        placement->n_cpus = n_cpus;
+        free(topology);
+
+        return 0;
+    }
+
+    for (const char* ptr = policy; *ptr != '\0';)
+    {
+        char* end = NULL;
+        long first = strtol(ptr, &end, 10);
+        long last  = first;
+
+        if (end != ptr && *end == '-')
+            last = strtol(end + 1, &end, 10);
+
+        if (end == ptr || first < 0 || last < first || last >= CPU_SETSIZE ||
+            (*end != ',' && *end != '\0'))
+            return error("invalid affinity '%s': compact, scatter or a CPU list\n", policy);
+
+        for (long cpu = first; cpu <= last && placement->n_cpus < CPU_SETSIZE; cpu++)
+        {
+            if (!CPU_ISSET((size_t) cpu, &allowed))
+                return error("CPU %ld is not available\n", cpu);
+
+            placement->cpus[placement->n_cpus++] = (int) cpu;
+        }
+
+        ptr = *end == ',' ? end + 1 : end;
+    }
+
+    if (placement->n_cpus == 0)
+        return error("invalid affinity '%s': no CPUs\n", policy);
+
+    return 0;
+}
+
+static void
+cpuPlacementDtor(CpuPlacement* placement)
+{
+    free(placement->cpus);
+}
+
+/* pthread_create() with the index-th thread pinned by placement, if any */
+static int
+startThread(pthread_t* tid, const CpuPlacement* placement, size_t index,
+            void* (*start)(void*), void* arg)
+{
+    if (!placement || placement->n_cpus == 0)
+        return pthread_create(tid, NULL, start, arg);
+
+    cpu_set_t cpu_set = {};
+    CPU_ZERO(&cpu_set);
+    CPU_SET((size_t) placement->cpus[index % placement->n_cpus], &cpu_set);
+
+    pthread_attr_t attr = {};
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set);
+
+    int err = pthread_create(tid, &attr, start, arg);
+
+    pthread_attr_destroy(&attr);
+
+    return err;
+}
+
+static int
+parseSize(const char* str, size_t* size)
 {
-    if (getopt(argc, argv, "") != -1)
+    char* end = NULL;
+
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno != 0 || end == str)
+        return 1;
+
+    switch (*end)
+    {
+        case 'M': value <<= 10; /* fall through */
+        case 'K': value <<= 10; end++; break;
+        default: break;
+    }
+
+    if (*end != '\0' || value == 0 || value > (1u << 30))
         return 1;
-    
+
+    *size = (size_t) value;
+
+    return 0;
+}
+
+static int
+parseArgs(int argc, char* argv[], Args* args)
+{
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "ab:n:j:szC:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                args->is_adaptive = 1;
+                break;
+            case 'z':
+                args->is_splice = 1;
+                break;
+            case 'C':
+                args->affinity = optarg;
+                break;
+            case 's':
+                args->is_stats = 1;
+                break;
+            case 'j':
+                args->n_readers = atoi(optarg);
+                if (args->n_readers < 1)
+                    return error("invalid number of readers '%s'\n", optarg);
+                break;
+            case 'b':
+                if (parseSize(optarg, &args->chunk_sz) != 0 || args->chunk_sz < 2)
+                    return error("invalid chunk size '%s'\n", optarg);
+                break;
+            case 'n':
+                if (parseSize(optarg, &args->n_chunks) != 0 || args->n_chunks > (1u << 20))
+                    return error("invalid ring depth '%s'\n", optarg);
+                break;
+            case '?':
+            default:
+                return 1;
+        }
+    }
+
+    if (args->chunk_sz == 0)
+        args->chunk_sz = args->is_adaptive || args->is_splice ? ADAPTIVE_MAX_CHUNK_SZ : CHUNK_SZ;
+
+    if (args->n_chunks == 0)
+        args->n_chunks = N_CHUNKS;
+
+    if (args->n_readers == 0)
+        args->n_readers = 1;
+
     args->n_files   = argc - optind;
     args->files_arr = argv + optind;
 
     return 0;
 }
 
+/* Time one side of a ring spent blocked on the other, printed by -s */
+typedef struct
+{
+    uint64_t n_stalls;
+    uint64_t stall_ns;
+} StallStats;
+
+static uint64_t
+nowNs(void)
+{
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void
+stallStatsAdd(StallStats* stats, uint64_t start_ns)
+{
+    stats->n_stalls++;
+    stats->stall_ns += nowNs() - start_ns;
+}
+
+/*
+    Size of the chunk closing the ring. The consumer gets 1 from
+    circBufferAcquireFull() instead of it, as many times as it asks.
+*/
+static const size_t CIRCBUF_EOS = SIZE_MAX;
+
+/*
+    Original mutex/condvar ring, kept for comparison: make mutex builds
+    threadcat-mutex with it.
+*/
+#ifdef CIRCBUF_MUTEX
+
 typedef struct
 {
     size_t buffer_cap;
@@ -57,6 +379,9 @@ typedef struct
     char*   buffers_data;
     size_t* buffers_sz;
 
+    StallStats full_stats;
+    StallStats empty_stats;
+
     pthread_mutex_t mutex;
     pthread_cond_t  not_empty;
     pthread_cond_t  not_full;
@@ -105,6 +430,7 @@ circBufferDtor(CircBuffer* cbuf)
     pthread_mutex_destroy(&cbuf->mutex);
 
     free(cbuf->buffers_data);
+    free(cbuf->buffers_sz);
 
     return 0;
 }
@@ -117,6 +443,17 @@ circBufferGetCap(CircBuffer* cbuf)
     return cbuf->buffer_cap;
 }
 
+/* Number of full chunks, a snapshot */
+static size_t
+circBufferGetSize(CircBuffer* cbuf)
+{
+    pthread_mutex_lock(&cbuf->mutex);
+    size_t size = cbuf->size;
+    pthread_mutex_unlock(&cbuf->mutex);
+
+    return size;
+}
+
 static int
 circBufferAcquireEmpty(CircBuffer* cbuf, char** dest)
 {
@@ -124,7 +461,12 @@ circBufferAcquireEmpty(CircBuffer* cbuf, char** dest)
     $DBG("Entered");
 
     if (cbuf->size == cbuf->n_buffer)
-        pthread_cond_wait(&cbuf->not_full, &cbuf->mutex); /* error handle */
+    {
+        uint64_t start_ns = nowNs();
+        while (cbuf->size == cbuf->n_buffer)
+            pthread_cond_wait(&cbuf->not_full, &cbuf->mutex);
+        stallStatsAdd(&cbuf->full_stats, start_ns);
+    }
 
     *dest = cbuf->buffers_data + cbuf->tail * cbuf->buffer_cap;
 
@@ -170,7 +512,11 @@ circBufferAcquireFull(CircBuffer* cbuf, char** dest, size_t* buf_sz)
     {
         $DBG("waiting for not_empty");
         $DBG("cbuf=%p, &cbuf=%p", cbuf, &cbuf);
-        pthread_cond_wait(&cbuf->not_empty, &cbuf->mutex);
+
+        uint64_t start_ns = nowNs();
+        while (cbuf->size == 0)
+            pthread_cond_wait(&cbuf->not_empty, &cbuf->mutex);
+        stallStatsAdd(&cbuf->empty_stats, start_ns);
     }
 
     $DBG("writing return arguments");
@@ -180,7 +526,7 @@ circBufferAcquireFull(CircBuffer* cbuf, char** dest, size_t* buf_sz)
     $DBG("Leaving");
     pthread_mutex_unlock(&cbuf->mutex);
 
-    return 0;
+    return *buf_sz == CIRCBUF_EOS;
 }
 
 static int
@@ -203,16 +549,361 @@ circBufferReleaseFull(CircBuffer* cbuf)
     return 0;
 }
 
+static void
+circBufferGetStats(CircBuffer* cbuf, StallStats* full_stats, StallStats* empty_stats)
+{
+    pthread_mutex_lock(&cbuf->mutex);
+    *full_stats  = cbuf->full_stats;
+    *empty_stats = cbuf->empty_stats;
+    pthread_mutex_unlock(&cbuf->mutex);
+}
+
+#else /* CIRCBUF_MUTEX */
+
+/*
+    Lock-free single-producer/single-consumer ring. head and tail are
+    free-running counters, each written by one side only and kept on its
+    own cache line together with the flag telling that side is parked.
+    Slot count is rounded up to a power of two, so counters may wrap.
+
+    A side that finds the ring full (empty) spins for a while, then sets
+    its parked flag and sleeps on the futex of the other side's counter.
+    The other side checks the flag after publishing its counter; fences
+    on both sides make sure either the sleeper sees the new counter or
+    the publisher sees the flag.
+*/
+
+#define CACHE_LINE_SZ 64
+
+/*
+    Re-checks of the peer's counter before falling asleep. On a single
+    CPU the peer cannot make progress while we spin, so we do not.
+*/
+static const int SPIN_COUNT = 256;
+
+typedef struct
+{
+    size_t buffer_cap;
+    size_t n_buffer;
+    size_t mask;
+    int    spin_count;
+
+    char*   buffers_data;
+    size_t* buffers_sz;
+
+    /* producer side */
+    alignas(CACHE_LINE_SZ) atomic_uint tail;
+    atomic_int is_producer_parked;
+    unsigned   head_cache;
+    StallStats full_stats;
+
+    /* consumer side */
+    alignas(CACHE_LINE_SZ) atomic_uint head;
+    atomic_int is_consumer_parked;
+    unsigned   tail_cache;
+    StallStats empty_stats;
+} CircBuffer;
+
+static long
+futex(atomic_uint* word, int op, unsigned value)
+{
+    return syscall(SYS_futex, word, op, value, NULL, NULL, 0);
+}
+
+/* Sleeps while *word == value */
+static void
+circBufferPark(atomic_uint* word, unsigned value, atomic_int* is_parked)
+{
+    atomic_store_explicit(is_parked, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(word, memory_order_relaxed) == value)
+        futex(word, FUTEX_WAIT_PRIVATE, value);
+
+    atomic_store_explicit(is_parked, 0, memory_order_relaxed);
+}
+
+static void
+circBufferUnpark(atomic_uint* word, atomic_int* is_parked)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(is_parked, memory_order_relaxed))
+        futex(word, FUTEX_WAKE_PRIVATE, 1);
+}
+
+/*
+    Waits until the peer's counter differs from `value`, which is what
+    both sides need: consumer waits for tail != head, producer for
+    head != tail - n_buffer. Returns the new counter.
+*/
+static unsigned
+circBufferWait(atomic_uint* word, unsigned value, atomic_int* is_parked, int spin_count)
+{
+    while (1)
+    {
+        for (int i = 0; i < spin_count; i++)
+        {
+            unsigned current = atomic_load_explicit(word, memory_order_acquire);
+            if (current != value)
+                return current;
+
+            __builtin_ia32_pause();
+        }
+
+        circBufferPark(word, value, is_parked);
+
+        unsigned current = atomic_load_explicit(word, memory_order_acquire);
+        if (current != value)
+            return current;
+    }
+}
+
+static int
+circBufferCtor(CircBuffer* cbuf, size_t buffer_cap, size_t n_buffer)
+{
+    assert(buffer_cap > 0 && n_buffer > 0 && "circular buffer with 0 size");
+
+    size_t n_slots = 1;
+    while (n_slots < n_buffer)
+        n_slots <<= 1;
+
+    char* tmp_data = (char*) malloc(buffer_cap * n_slots * sizeof(char));
+    if (tmp_data == NULL)
+        return -1;
+
+    size_t* tmp_sz = (size_t*) malloc(n_slots * sizeof(size_t));
+    if (tmp_sz == NULL)
+    {
+        free(tmp_data);
+        return -1;
+    }
+
+    cbuf->buffer_cap = buffer_cap;
+    cbuf->n_buffer   = n_slots;
+    cbuf->mask       = n_slots - 1;
+    cbuf->spin_count = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_COUNT : 0;
+
+    cbuf->buffers_data = tmp_data;
+    cbuf->buffers_sz   = tmp_sz;
+
+    atomic_init(&cbuf->tail, 0);
+    atomic_init(&cbuf->head, 0);
+    atomic_init(&cbuf->is_producer_parked, 0);
+    atomic_init(&cbuf->is_consumer_parked, 0);
+
+    cbuf->head_cache = 0;
+    cbuf->tail_cache = 0;
+
+    cbuf->full_stats  = (StallStats) {};
+    cbuf->empty_stats = (StallStats) {};
+
+    return 0;
+}
+
+static int
+circBufferDtor(CircBuffer* cbuf)
+{
+    free(cbuf->buffers_data);
+    free(cbuf->buffers_sz);
+
+    return 0;
+}
+
+static size_t
+circBufferGetCap(CircBuffer* cbuf)
+{
+    assert(cbuf->buffer_cap);
+
+    return cbuf->buffer_cap;
+}
+
+/* Number of full chunks, a snapshot */
+static size_t
+circBufferGetSize(CircBuffer* cbuf)
+{
+    unsigned tail = atomic_load_explicit(&cbuf->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&cbuf->head, memory_order_relaxed);
+
+    return tail - head;
+}
+
+static int
+circBufferAcquireEmpty(CircBuffer* cbuf, char** dest)
+{
+    unsigned tail = atomic_load_explicit(&cbuf->tail, memory_order_relaxed);
+
+    if (tail - cbuf->head_cache == cbuf->n_buffer)
+    {
+        cbuf->head_cache = atomic_load_explicit(&cbuf->head, memory_order_acquire);
+        if (tail - cbuf->head_cache == cbuf->n_buffer)
+        {
+            $DBG("waiting for not_full");
+            uint64_t start_ns = nowNs();
+            cbuf->head_cache = circBufferWait(&cbuf->head, tail - (unsigned) cbuf->n_buffer,
+                                              &cbuf->is_producer_parked, cbuf->spin_count);
+            stallStatsAdd(&cbuf->full_stats, start_ns);
+        }
+    }
+
+    *dest = cbuf->buffers_data + (tail & cbuf->mask) * cbuf->buffer_cap;
+
+    return 0;
+}
+
+static int
+circBufferReleaseEmpty(CircBuffer* cbuf, size_t buf_sz)
+{
+    unsigned tail = atomic_load_explicit(&cbuf->tail, memory_order_relaxed);
+    assert(tail - cbuf->head_cache < cbuf->n_buffer && "write release with full circbuffer");
+
+    cbuf->buffers_sz[tail & cbuf->mask] = buf_sz;
+    atomic_store_explicit(&cbuf->tail, tail + 1, memory_order_release);
+
+    circBufferUnpark(&cbuf->tail, &cbuf->is_consumer_parked);
+
+    return 0;
+}
+
+static int
+circBufferAcquireFull(CircBuffer* cbuf, char** dest, size_t* buf_sz)
+{
+    unsigned head = atomic_load_explicit(&cbuf->head, memory_order_relaxed);
+
+    if (cbuf->tail_cache == head)
+    {
+        cbuf->tail_cache = atomic_load_explicit(&cbuf->tail, memory_order_acquire);
+        if (cbuf->tail_cache == head)
+        {
+            $DBG("waiting for not_empty");
+            uint64_t start_ns = nowNs();
+            cbuf->tail_cache = circBufferWait(&cbuf->tail, head, &cbuf->is_consumer_parked,
+                                              cbuf->spin_count);
+            stallStatsAdd(&cbuf->empty_stats, start_ns);
+        }
+    }
+
+    *dest   = cbuf->buffers_data + (head & cbuf->mask) * cbuf->buffer_cap;
+    *buf_sz = cbuf->buffers_sz[head & cbuf->mask];
+
+    return *buf_sz == CIRCBUF_EOS;
+}
+
+static int
+circBufferReleaseFull(CircBuffer* cbuf)
+{
+    unsigned head = atomic_load_explicit(&cbuf->head, memory_order_relaxed);
+    assert(cbuf->tail_cache != head && "read release with zero size");
+
+    atomic_store_explicit(&cbuf->head, head + 1, memory_order_release);
+
+    /* a full ring is refilled in batches of half of it, not slot by slot */
+    unsigned tail = atomic_load_explicit(&cbuf->tail, memory_order_relaxed);
+    if (tail - (head + 1) <= cbuf->n_buffer / 2)
+        circBufferUnpark(&cbuf->head, &cbuf->is_producer_parked);
+
+    return 0;
+}
+
+/* Only valid once both sides are joined */
+static void
+circBufferGetStats(CircBuffer* cbuf, StallStats* full_stats, StallStats* empty_stats)
+{
+    *full_stats  = cbuf->full_stats;
+    *empty_stats = cbuf->empty_stats;
+}
+
+#endif /* CIRCBUF_MUTEX */
+
+/*
+    Producer's last call: the consumer drains what is left and then
+    gets 1 from every circBufferAcquireFull().
+*/
+static int
+circBufferClose(CircBuffer* cbuf)
+{
+    char* slot = NULL;
+
+    circBufferAcquireEmpty(cbuf, &slot);
+
+    return circBufferReleaseEmpty(cbuf, CIRCBUF_EOS);
+}
+
 /******************************************************************************/
 
 static int
-readToCbuf(CircBuffer* cbuf, int fd)
+writeAll(int fd, const char* buf, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n_written = write(fd, buf, size);
+        if (n_written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        buf  += n_written;
+        size -= (size_t) n_written;
+    }
+
+    return 0;
+}
+
+/*
+    Largest chunk worth reading from fd in adaptive mode: st_blksize of
+    a file, capacity of a pipe, the minimum for a terminal, where every
+    line should reach the output as soon as it is typed.
+*/
+static size_t
+adaptiveLimit(int fd, size_t buf_cap)
+{
+    size_t limit = buf_cap;
+    struct stat statbuf = {};
+
+    if (isatty(fd))
+    {
+        limit = ADAPTIVE_MIN_CHUNK_SZ;
+    }
+    else if (fstat(fd, &statbuf) == 0)
+    {
+        if (S_ISFIFO(statbuf.st_mode))
+        {
+            int pipe_sz = fcntl(fd, F_GETPIPE_SZ);
+            if (pipe_sz > 0)
+                limit = (size_t) pipe_sz;
+        }
+        else if (statbuf.st_blksize > 0)
+        {
+            limit = (size_t) statbuf.st_blksize;
+        }
+    }
+
+    if (limit < ADAPTIVE_MIN_CHUNK_SZ)
+        limit = ADAPTIVE_MIN_CHUNK_SZ;
+
+    return limit < buf_cap ? limit : buf_cap;
+}
+
+/*
+    In adaptive mode chunk size doubles after every full read while the
+    writer is at most one chunk behind, and halves after reads returning
+    less than a quarter of it: such an input is latency-bound, and small
+    chunks get its data out sooner.
+*/
+static int
+readToCbuf(CircBuffer* cbuf, int fd, int is_adaptive)
 {
     $DBG("Entered");
     char* buf = NULL;
     ssize_t n_read = 0;
     size_t buf_cap = circBufferGetCap(cbuf);
 
+    size_t limit    = is_adaptive ? adaptiveLimit(fd, buf_cap) : buf_cap;
+    size_t chunk_sz = is_adaptive && ADAPTIVE_MIN_CHUNK_SZ < limit ? ADAPTIVE_MIN_CHUNK_SZ : limit;
+
     int saved_errno = 0;
 
     do
@@ -220,14 +911,25 @@ readToCbuf(CircBuffer* cbuf, int fd)
         $DBG("Acquiring empty");
         circBufferAcquireEmpty(cbuf, &buf);
 
-        n_read = read(fd, buf, buf_cap - 1);
+        n_read = read(fd, buf, chunk_sz - 1);
         if (n_read > 0)
             buf[n_read] = '\0';
         else
             saved_errno = errno;
 
+        /* a failed read ends the stream like EOF does */
         $DBG("Releasing empty");
-        circBufferReleaseEmpty(cbuf, (size_t) n_read);
+        circBufferReleaseEmpty(cbuf, n_read > 0 ? (size_t) n_read : 0);
+
+        if (is_adaptive && n_read > 0)
+        {
+            if ((size_t) n_read == chunk_sz - 1 && chunk_sz < limit && circBufferGetSize(cbuf) <= 1)
+                chunk_sz = chunk_sz * 2 < limit ? chunk_sz * 2 : limit;
+            else if ((size_t) n_read < chunk_sz / 4 && chunk_sz / 2 >= ADAPTIVE_MIN_CHUNK_SZ)
+                chunk_sz /= 2;
+
+            $DBG("chunk size %zu", chunk_sz);
+        }
     }
     while (n_read > 0);
 
@@ -238,66 +940,275 @@ readToCbuf(CircBuffer* cbuf, int fd)
     return 0;
 }
 
+/*
+    Writes out one stream, up to its empty chunk. Short writes are
+    retried. After a failed write the rest is drained unwritten, so that
+    readers never block on a full ring. Returns 1 if the ring got closed
+    before the stream ended.
+*/
 static int
-writeFromCbuf(int fd, CircBuffer* cbuf)
+writeFromCbuf(int fd, CircBuffer* cbuf, int* is_broken)
 {
     $DBG("Entered");
     char* buf = NULL;
     size_t buf_sz = 0;
 
-    /* should be cancelled */
-    while (1)
+    do
     {
-        circBufferAcquireFull(cbuf, &buf, &buf_sz);
+        if (circBufferAcquireFull(cbuf, &buf, &buf_sz) != 0)
+            return 1;
 #ifndef DEBUG
-        write(fd, buf, buf_sz);
+        if (!*is_broken && writeAll(fd, buf, buf_sz) != 0)
+        {
+            error("write failed: %s\n", strerror(errno));
+            *is_broken = 1;
+        }
 #endif
         circBufferReleaseFull(cbuf);
     }
+    while (buf_sz > 0);
 
-    assert(0 && "unreachable");
-    return -1;
+    return 0;
 }
 
+/*
+    Zero-copy mode (-z): the reader splices input into an internal pipe
+    and the writer splices it onward to stdout, so data never enters
+    user space. Ring slots carry only the descriptor to splice from and
+    the length of each chunk, pipe keeps the bytes in the same order.
+*/
+typedef struct
+{
+    int    rd;
+    int    wr;
+    size_t chunk_sz;
+} SplicePipe;
+
 static int
-catFiles(CircBuffer* cbuf, const Args* args)
+splicePipeCtor(SplicePipe* splice_pipe, size_t chunk_sz, size_t n_chunks)
+{
+    int fds[2] = {};
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        return -1;
+
+    splice_pipe->rd = fds[0];
+    splice_pipe->wr = fds[1];
+
+    /* best effort, pipe-max-size may be lower */
+    fcntl(splice_pipe->wr, F_SETPIPE_SZ, (int) (chunk_sz * n_chunks));
+
+    /*
+        A read/write fallback chunk must fit in the pipe at once, or
+        the reader blocks on data the writer does not know about yet.
+    */
+    int pipe_sz = fcntl(splice_pipe->wr, F_GETPIPE_SZ);
+    if (pipe_sz > 0 && (size_t) pipe_sz < chunk_sz)
+        chunk_sz = (size_t) pipe_sz;
+
+    splice_pipe->chunk_sz = chunk_sz < SPLICE_FALLBACK_SZ ? SPLICE_FALLBACK_SZ : chunk_sz;
+
+    return 0;
+}
+
+static void
+splicePipeDtor(SplicePipe* splice_pipe)
+{
+    close(splice_pipe->rd);
+    close(splice_pipe->wr);
+}
+
+/*
+    Inputs splice(2) cannot read from, a terminal for one, are copied
+    into the pipe with read/write instead, chunks never exceed
+    SPLICE_FALLBACK_SZ then.
+*/
+static int
+spliceToCbuf(CircBuffer* cbuf, int fd, const SplicePipe* splice_pipe)
+{
+    $DBG("Entered");
+    char* slot = NULL;
+    ssize_t n_read = 0;
+    int is_splice = 1;
+
+    char buffer[SPLICE_FALLBACK_SZ];
+    int saved_errno = 0;
+
+    do
+    {
+        circBufferAcquireEmpty(cbuf, &slot);
+
+        if (is_splice)
+        {
+            n_read = splice(fd, NULL, splice_pipe->wr, NULL, splice_pipe->chunk_sz,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n_read == -1 && (errno == EINVAL || errno == ENOSYS))
+                is_splice = 0;
+        }
+
+        if (!is_splice)
+        {
+            n_read = read(fd, buffer, sizeof(buffer));
+            if (n_read > 0 && writeAll(splice_pipe->wr, buffer, (size_t) n_read) != 0)
+                n_read = -1;
+        }
+
+        if (n_read < 0)
+            saved_errno = errno;
+
+        memcpy(slot, &splice_pipe->rd, sizeof(splice_pipe->rd));
+        circBufferReleaseEmpty(cbuf, n_read > 0 ? (size_t) n_read : 0);
+    }
+    while (n_read > 0);
+
+    if (n_read < 0)
+        return error("splice failed: %s\n", strerror(saved_errno));
+
+    $DBG("Leaving");
+    return 0;
+}
+
+/*
+    Moves one stream from its internal pipe to fd, with the same return
+    value and error handling as writeFromCbuf(). Outputs splice(2) cannot
+    write to (a terminal, a file opened with O_APPEND) get it through a
+    bounce buffer instead.
+*/
+static int
+spliceFromCbuf(int fd, CircBuffer* cbuf, int* is_broken)
+{
+    $DBG("Entered");
+    char* slot = NULL;
+    size_t chunk_sz = 0;
+    int is_splice = !*is_broken;
+
+    char buffer[SPLICE_FALLBACK_SZ];
+
+    do
+    {
+        if (circBufferAcquireFull(cbuf, &slot, &chunk_sz) != 0)
+            return 1;
+
+        int pipe_rd = -1;
+        memcpy(&pipe_rd, slot, sizeof(pipe_rd));
+
+        size_t left = chunk_sz;
+        while (left > 0)
+        {
+            ssize_t n_moved = -1;
+            if (is_splice)
+            {
+                n_moved = splice(pipe_rd, NULL, fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (n_moved == -1 && errno == EINVAL)
+                    is_splice = 0;
+            }
+
+            if (!is_splice)
+            {
+                n_moved = read(pipe_rd, buffer, left < sizeof(buffer) ? left : sizeof(buffer));
+
+                /* the failed splice may have eaten part of the chunk */
+                if (n_moved == -1 && errno == EAGAIN)
+                    break;
+
+                if (n_moved > 0 && !*is_broken && writeAll(fd, buffer, (size_t) n_moved) != 0)
+                    n_moved = -1;
+            }
+
+            if (n_moved <= 0)
+            {
+                if (n_moved == -1 && errno == EINTR)
+                    continue;
+
+                /* output is gone, keep draining the pipe so the reader is not stuck */
+                error("write failed: %s\n", strerror(errno));
+                is_splice  = 0;
+                *is_broken = 1;
+                fcntl(pipe_rd, F_SETFL, fcntl(pipe_rd, F_GETFL) | O_NONBLOCK);
+                continue;
+            }
+
+            left -= (size_t) n_moved;
+        }
+
+        circBufferReleaseFull(cbuf);
+    }
+    while (chunk_sz > 0);
+
+    return 0;
+}
+
+static int
+readFd(CircBuffer* cbuf, int fd, const Args* args, const SplicePipe* splice_pipe)
+{
+    if (splice_pipe)
+        return spliceToCbuf(cbuf, fd, splice_pipe);
+
+    return readToCbuf(cbuf, fd, args->is_adaptive);
+}
+
+/*
+    Reads every n_readers-th file starting from first_file. A file that
+    cannot be opened still gets its empty chunk, so that the writer can
+    go on with the next one.
+*/
+static int
+catFiles(CircBuffer* cbuf, const Args* args, const SplicePipe* splice_pipe, int first_file)
 {
     char* filename = NULL;
+    char* slot = NULL;
     int fd = 0;
+    int retval = 0;
  
-    for (int file_num = 0; file_num < args->n_files; file_num++)
+    for (int file_num = first_file; file_num < args->n_files; file_num += args->n_readers)
     {
         filename = args->files_arr[file_num];
 
         $DBG("cat files: opening %s", filename);
         fd = open(filename, O_RDONLY);
         if (fd == -1)
-            return error("cannot open %s: %s\n", filename, strerror(errno));
+        {
+            retval = error("cannot open %s: %s\n", filename, strerror(errno));
+
+            circBufferAcquireEmpty(cbuf, &slot);
+            if (splice_pipe)
+                memcpy(slot, &splice_pipe->rd, sizeof(splice_pipe->rd));
+            circBufferReleaseEmpty(cbuf, 0);
+            continue;
+        }
 
-        readToCbuf(cbuf, fd);
+        if (readFd(cbuf, fd, args, splice_pipe) != 0)
+            retval = 1;
 
         $DBG("cat files: closing %s", filename);
         close(fd);
         fd = 0;
     }
 
-    return 0;
+    return retval;
 }
 
 static int
-catInteractive(CircBuffer* cbuf)
+catInteractive(CircBuffer* cbuf, const Args* args, const SplicePipe* splice_pipe)
 {
-    readToCbuf(cbuf, STDIN_FILENO);
-
-    return 0;
+    return readFd(cbuf, STDIN_FILENO, args, splice_pipe);
 }
 
 /*****************************************************************************/
 
+/*
+    Every reader owns a ring (and in zero-copy mode a pipe) and fills it
+    with files first_file, first_file + n_readers, ... one after another,
+    each ended by an empty chunk. The writer is the sequencer: it takes
+    file i from ring i % n_readers, so output follows argv order while
+    up to n_readers files are read at once.
+*/
 typedef struct
 {
     CircBuffer* cbuf;
     const Args* args;
+    const SplicePipe* splice_pipe;
+    int first_file;
+    int retval;
 } ReaderArgs;
 
 static void*
@@ -311,9 +1222,11 @@ readerStart(void* arg_ptr)
         $DBG("\t%s", ptr->args->files_arr[i]);
 
     if (ptr->args->n_files == 0)
-        catInteractive(ptr->cbuf);
+        ptr->retval = catInteractive(ptr->cbuf, ptr->args, ptr->splice_pipe);
     else
-        catFiles(ptr->cbuf, ptr->args);
+        ptr->retval = catFiles(ptr->cbuf, ptr->args, ptr->splice_pipe, ptr->first_file);
+
+    circBufferClose(ptr->cbuf);
 
     $DBG("reader returning");
     return NULL;
@@ -322,7 +1235,11 @@ readerStart(void* arg_ptr)
 typedef struct
 {
     int fd;
-    CircBuffer* cbuf;
+    CircBuffer* cbufs;
+    int n_cbufs;
+    int n_streams;
+    int is_splice;
+    int is_broken;
 } WriterArgs;
 
 static void*
@@ -330,12 +1247,47 @@ writerStart(void* arg_ptr)
 {
     $DBG("writer started, stack: %p", &arg_ptr);
     WriterArgs* ptr = (WriterArgs*) arg_ptr;
-    writeFromCbuf(ptr->fd, ptr->cbuf);
+
+    for (int i = 0; i < ptr->n_streams; i++)
+    {
+        CircBuffer* cbuf = &ptr->cbufs[i % ptr->n_cbufs];
+
+        if (ptr->is_splice)
+            spliceFromCbuf(ptr->fd, cbuf, &ptr->is_broken);
+        else
+            writeFromCbuf(ptr->fd, cbuf, &ptr->is_broken);
+    }
 
     $DBG("writer returning");
     return NULL;
 }
 
+/*
+    -s: time every reader spent blocked on its full ring (writer is the
+    bottleneck) and the writer spent blocked on empty ones (readers are).
+*/
+static void
+printStats(CircBuffer* cbufs, int n_cbufs)
+{
+    StallStats writer_stats = {};
+
+    for (int i = 0; i < n_cbufs; i++)
+    {
+        StallStats full_stats  = {};
+        StallStats empty_stats = {};
+        circBufferGetStats(&cbufs[i], &full_stats, &empty_stats);
+
+        fprintf(stderr, "%s: reader %d: %" PRIu64 " stalls, %.3f ms blocked on full ring\n",
+                PROGNAME, i, full_stats.n_stalls, (double) full_stats.stall_ns / 1e6);
+
+        writer_stats.n_stalls += empty_stats.n_stalls;
+        writer_stats.stall_ns += empty_stats.stall_ns;
+    }
+
+    fprintf(stderr, "%s: writer: %" PRIu64 " stalls, %.3f ms blocked on empty rings\n",
+            PROGNAME, writer_stats.n_stalls, (double) writer_stats.stall_ns / 1e6);
+}
+
 /*****************************************************************************/
 
 int
@@ -347,33 +1299,120 @@ main(int argc, char* argv[])
     if (parseArgs(argc, argv, &args) != 0)
         return 1;
 
+    if (args.n_readers > args.n_files)
+        args.n_readers = args.n_files > 0 ? args.n_files : 1;
+
+    /* readers take the first CPUs of the policy, the writer the next one */
+    CpuPlacement placement = {};
+    if (args.affinity && cpuPlacementCtor(&placement, args.affinity) != 0)
+    {
+        cpuPlacementDtor(&placement);
+        return 1;
+    }
+
     int retval = 0;
+    int n_readers = args.n_readers;
+
+    CircBuffer* cbufs        = calloc((size_t) n_readers, sizeof(CircBuffer));
+    SplicePipe* pipes        = calloc((size_t) n_readers, sizeof(SplicePipe));
+    ReaderArgs* reader_args  = calloc((size_t) n_readers, sizeof(ReaderArgs));
+    pthread_t*  reader_tids  = calloc((size_t) n_readers, sizeof(pthread_t));
+    int n_cbufs = 0;
+    int n_pipes = 0;
+    int n_started = 0;
+
+    if (!cbufs || !pipes || !reader_args || !reader_tids)
+    {
+        retval = error("%s\n", strerror(ENOMEM));
+        goto finally;
+    }
 
-    CircBuffer cbuf = {0};
-    circBufferCtor(&cbuf, 256, 16);
+    for (; n_pipes < n_readers && args.is_splice; n_pipes++)
+    {
+        if (splicePipeCtor(&pipes[n_pipes], args.chunk_sz, args.n_chunks) != 0)
+        {
+            retval = error("%s\n", strerror(errno));
+            goto finally;
+        }
+    }
 
-    $DBG("starting reader");
-    pthread_t reader_tid = 0;
-    ReaderArgs reader_args = {.args = &args, .cbuf = &cbuf};
-    pthread_create(&reader_tid, NULL, readerStart, &reader_args); 
+    /*
+        In zero-copy mode a slot holds just the pipe descriptor. Slots are
+        left untouched, so they are allocated on the node of their reader.
+    */
+    for (; n_cbufs < n_readers; n_cbufs++)
+    {
+        if (circBufferCtor(&cbufs[n_cbufs], args.is_splice ? sizeof(int) : args.chunk_sz, args.n_chunks) != 0)
+        {
+            retval = error("%s\n", strerror(ENOMEM));
+            goto finally;
+        }
+    }
+
+    $DBG("starting readers");
+    for (; n_started < n_readers; n_started++)
+    {
+        reader_args[n_started] = (ReaderArgs) {.args = &args, .cbuf = &cbufs[n_started],
+                                               .splice_pipe = args.is_splice ? &pipes[n_started] : NULL,
+                                               .first_file = n_started};
+
+        int err = startThread(&reader_tids[n_started], &placement, (size_t) n_started,
+                              readerStart, &reader_args[n_started]);
+        if (err != 0)
+        {
+            retval = error("cannot start reader: %s\n", strerror(err));
+            goto finally;
+        }
+    }
 
     $DBG("starting writer");
     pthread_t writer_tid = 0;
-    WriterArgs writer_args = {.fd = STDOUT_FILENO, .cbuf = &cbuf};
-    pthread_create(&writer_tid, NULL, writerStart, &writer_args); 
+    WriterArgs writer_args = {.fd = STDOUT_FILENO, .cbufs = cbufs, .n_cbufs = n_readers,
+                              .n_streams = args.n_files > 0 ? args.n_files : 1,
+                              .is_splice = args.is_splice};
 
-    $DBG("joining reader");
-    void* thread_retval = NULL;
-    retval = pthread_join(reader_tid, &thread_retval);
+    int err = startThread(&writer_tid, &placement, (size_t) n_readers, writerStart, &writer_args);
+    if (err != 0)
+    {
+        retval = error("cannot start writer: %s\n", strerror(err));
+        goto finally;
+    }
 
+    $DBG("joining readers");
+    for (int i = 0; i < n_started; i++)
+    {
+        pthread_join(reader_tids[i], NULL);
+        if (reader_args[i].retval != 0)
+            retval = 1;
+    }
+    n_started = 0;
+
+    /* every ring ends with an end-of-stream chunk, writer drains them and returns */
     $DBG("joining writer");
-    retval = pthread_cancel(writer_tid);
-    if (retval != 0)
-        error("writer cancel failed: %s\n", strerror(retval));
-    pthread_join(writer_tid, &thread_retval);
+    pthread_join(writer_tid, NULL);
+    if (writer_args.is_broken)
+        retval = 1;
+
+    if (args.is_stats)
+        printStats(cbufs, n_cbufs);
+
+finally:
+    /* readers started before a failure cannot be stopped, just leave */
+    if (n_started > 0)
+        exit(EXIT_FAILURE);
 
     $DBG("main returning");
-    circBufferDtor(&cbuf);
+    for (int i = 0; i < n_cbufs; i++)
+        circBufferDtor(&cbufs[i]);
+
+    for (int i = 0; i < n_pipes; i++)
+        splicePipeDtor(&pipes[i]);
+
+    free(cbufs);
+    free(pipes);
+    free(reader_args);
+    free(reader_tids);
+    cpuPlacementDtor(&placement);
 
     return retval;
 }
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Sort time of every sort kernel (see -k) against libc qsort, on one
+# thread and on several, then of the sort-then-merge mode against sample
+# sort (see -m) for every input distribution, and of the thread placement
+# policies (see -C) on all CPUs. Prints the CSV report of
+# threadsort -f csv, median and percentiles over the repetitions.
+# usage: ./bench.sh [data_sz] [n_threads] [reps]
+#
+
+DATA_SZ=${1:-4000000}
+N_THREADS=${2:-4}
+REPS=${3:-5}
+
+header=
+bench()
+{
+    report=$(./threadsort -f csv -r "$REPS" "$@") || {
+        echo "threadsort $*: failed" >&2
+        exit 1
+    }
+
+    if [ -z "$header" ]
+    then
+        echo "$report" | head -n 1
+        header=1
+    fi
+
+    echo "$report" | grep ',\(sort\|merge\|total\),'
+}
+
+for kernel in qsort intro network radix auto
+do
+    bench -k "$kernel" "$DATA_SZ" 1
+    bench -k "$kernel" "$DATA_SZ" "$N_THREADS"
+done
+
+for dist in uniform sorted reverse few-unique zipf
+do
+    bench -m merge -d "$dist" "$DATA_SZ" "$N_THREADS"
+    bench -m sample -d "$dist" "$DATA_SZ" "$N_THREADS"
+done
+
+N_CPUS=$(nproc)
+for affinity in compact scatter
+do
+    bench -C "$affinity" "$DATA_SZ" "$N_CPUS"
+    bench -C "$affinity" -m sample "$DATA_SZ" "$N_CPUS"
+done
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,10 +7,16 @@
 #include <string.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <errno.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
+#include <stdint.h>
+#include <math.h>
+#include <limits.h>
+#include <immintrin.h>
 
 #ifdef DEBUG
     #define $DBG(FMT, ...) fprintf(stderr, "%s: " FMT "\n", __PRETTY_FUNCTION__, ##__VA_ARGS__)
@@ -32,6 +39,192 @@ error(char* fmt, ...)
 	return 1;
 }
 
+/*
+    Thread placement. compact fills the hardware threads of a core, then
+    the cores of a package before moving to the next one; scatter takes
+    one hardware thread of every core, alternating packages, before
+    doubling up; a list such as 0,2,8-11 is used as given. Only CPUs of
+    the process affinity mask are placed on. Thread i runs on
+    cpus[i % n_cpus] from its start, so the memory it touches first is
+    allocated on its node.
+*/
+typedef struct
+{
+    const char* policy;
+    int*        cpus;
+    size_t      n_cpus;
+} CpuPlacement;
+
+typedef struct
+{
+    int cpu;
+    int package;
+    int core;
+    int sibling;    /* rank among the hardware threads of the core */
+} CpuTopology;
+
+static int
+readTopology(int cpu, const char* name)
+{
+    char path[128] = {};
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+
+    int value = 0;
+    FILE* file = fopen(path, "r");
+    if (file)
+    {
+        if (fscanf(file, "%d", &value) != 1)
+            value = 0;
+
+        fclose(file);
+    }
+
+    return value;
+}
+
+static int
+compareInt(int arg1, int arg2)
+{
+    if (arg1 < arg2) return -1;
+    if (arg1 > arg2) return 1;
+    return 0;
+}
+
+static int
+compareCompact(const void* a, const void* b)
+{
+    const CpuTopology* arg1 = (const CpuTopology*) a;
+    const CpuTopology* arg2 = (const CpuTopology*) b;
+
+    if (arg1->package != arg2->package) return compareInt(arg1->package, arg2->package);
+    if (arg1->core    != arg2->core)    return compareInt(arg1->core,    arg2->core);
+    return compareInt(arg1->cpu, arg2->cpu);
+}
+
+static int
+compareScatter(const void* a, const void* b)
+{
+    const CpuTopology* arg1 = (const CpuTopology*) a;
+    const CpuTopology* arg2 = (const CpuTopology*) b;
+
+    if (arg1->sibling != arg2->sibling) return compareInt(arg1->sibling, arg2->sibling);
+    if (arg1->core    != arg2->core)    return compareInt(arg1->core,    arg2->core);
+    if (arg1->package != arg2->package) return compareInt(arg1->package, arg2->package);
+    return compareInt(arg1->cpu, arg2->cpu);
+}
+
+static int
+cpuPlacementCtor(CpuPlacement* placement, const char* policy)
+{
+    cpu_set_t allowed = {};
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return error("cannot get affinity: %s\n", strerror(errno));
+
+    placement->policy = policy;
+    placement->n_cpus = 0;
+    placement->cpus   = (int*) calloc(CPU_SETSIZE, sizeof(int));
+    if (!placement->cpus)
+        return error("cannot allocate memory\n");
+
+    int is_compact = strcmp(policy, "compact") == 0;
+    if (is_compact || strcmp(policy, "scatter") == 0)
+    {
+        CpuTopology* topology = (CpuTopology*) calloc(CPU_SETSIZE, sizeof(CpuTopology));
+        if (!topology)
+            return error("cannot allocate memory\n");
+
+        size_t n_cpus = 0;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (!CPU_ISSET((size_t) cpu, &allowed))
+                continue;
+
+            CpuTopology* info = &topology[n_cpus];
+            *info = (CpuTopology) {
+                .cpu     = cpu,
+                .package = readTopology(cpu, "physical_package_id"),
+                .core    = readTopology(cpu, "core_id")
+            };
+
+            for (size_t i = 0; i < n_cpus; i++)
+            {
+                if (topology[i].package == info->package && topology[i].core == info->core)
+                    info->sibling++;
+            }
+
+            n_cpus++;
+        }
+
+        qsort(topology, n_cpus, sizeof(CpuTopology), is_compact ? compareCompact : compareScatter);
+
+        for (size_t i = 0; i < n_cpus; i++)
+            placement->cpus[i] = topology[i].cpu;
+
+        placement->n_cpus = n_cpus;
+        free(topology);
+
+        return 0;
+    }
+
+    for (const char* ptr = policy; *ptr != '\0';)
+    {
+        char* end = NULL;
+        long first = strtol(ptr, &end, 10);
+        long last  = first;
+
+        if (end != ptr && *end == '-')
+            last = strtol(end + 1, &end, 10);
+
+        if (end == ptr || first < 0 || last < first || last >= CPU_SETSIZE ||
+            (*end != ',' && *end != '\0'))
+            return error("invalid affinity '%s': compact, scatter or a CPU list\n", policy);
+
+        for (long cpu = first; cpu <= last && placement->n_cpus < CPU_SETSIZE; cpu++)
+        {
+            if (!CPU_ISSET((size_t) cpu, &allowed))
+                return error("CPU %ld is not available\n", cpu);
+
+            placement->cpus[placement->n_cpus++] = (int) cpu;
+        }
+
+        ptr = *end == ',' ? end + 1 : end;
+    }
+
+    if (placement->n_cpus == 0)
+        return error("invalid affinity '%s': no CPUs\n", policy);
+
+    return 0;
+}
+
+static void
+cpuPlacementDtor(CpuPlacement* placement)
+{
+    free(placement->cpus);
+}
+
+/* pthread_create() with the index-th thread pinned by placement, if any */
+static int
+startThread(pthread_t* tid, const CpuPlacement* placement, size_t index,
+            void* (*start)(void*), void* arg)
+{
+    if (!placement || placement->n_cpus == 0)
+        return pthread_create(tid, NULL, start, arg);
+
+    cpu_set_t cpu_set = {};
+    CPU_ZERO(&cpu_set);
+    CPU_SET((size_t) placement->cpus[index % placement->n_cpus], &cpu_set);
+
+    pthread_attr_t attr = {};
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set), &cpu_set);
+
+    int err = pthread_create(tid, &attr, start, arg);
+
+    pthread_attr_destroy(&attr);
+
+    return err;
+}
+
 typedef struct
 {
     int* data;
@@ -66,174 +259,2280 @@ compareInts(const void* a, const void* b)
     return 0;
 }
 
-static int
-sorter(Buffer* buf)
+typedef enum
 {
-    $DBG("qsort");
-   
-    qsort(buf->data, buf->size, sizeof(int), compareInts);
-    
-    return 0;
+    KERNEL_AUTO,
+    KERNEL_QSORT,
+    KERNEL_INTRO,
+    KERNEL_NETWORK,
+    KERNEL_RADIX,
+    N_KERNELS
+} SortKernel;
+
+static const char* KERNEL_NAMES[N_KERNELS] = {
+    [KERNEL_AUTO]    = "auto",
+    [KERNEL_QSORT]   = "qsort",
+    [KERNEL_INTRO]   = "intro",
+    [KERNEL_NETWORK] = "network",
+    [KERNEL_RADIX]   = "radix"
+};
+
+/* Below this size four counting passes cost more than introsort */
+static const size_t RADIX_MIN_SZ = 1 << 12;
+static const size_t INSERTION_MAX_SZ = 16;
+
+#define NETWORK_SZ 8
+
+static inline void
+swapInts(int* a, int* b)
+{
+    int tmp = *a;
+    *a = *b;
+    *b = tmp;
 }
 
-static void*
-sorterStart(void* arg_ptr)
+static void
+insertionSort(int* data, size_t size)
 {
-    $DBG("sorter started, stack: %p", &arg_ptr);
-    Buffer* ptr = (Buffer*) arg_ptr;
+    for (size_t i = 1; i < size; i++)
+    {
+        int value = data[i];
+        size_t j = i;
 
-    sorter(ptr);
+        for (; j > 0 && data[j - 1] > value; j--)
+            data[j] = data[j - 1];
 
-    $DBG("sorter returning");
-    return NULL;
+        data[j] = value;
+    }
 }
 
-static int
-merger(Buffer* out, Buffer* in_arr, size_t in_arr_sz)
+#ifdef __AVX2__
+/*
+    One layer of the 19-comparator, depth 6 network for 8 inputs: every
+    lane meets its partner from PERM, lanes set in MAX_LANES keep the
+    greater value.
+*/
+#define NETWORK_LAYER(VEC, PERM, MAX_LANES)                                 \
+    do {                                                                    \
+        __m256i other = _mm256_permutevar8x32_epi32(VEC, PERM);             \
+        VEC = _mm256_blend_epi32(_mm256_min_epi32(VEC, other),              \
+                                 _mm256_max_epi32(VEC, other), MAX_LANES);  \
+    } while (0)
+
+static void
+networkSort(int* data, size_t size)
 {
-    while (out->offset < out->size)
-    {
-        Buffer* min = in_arr;
+    int lanes[NETWORK_SZ] = {INT_MAX, INT_MAX, INT_MAX, INT_MAX,
+                             INT_MAX, INT_MAX, INT_MAX, INT_MAX};
+    memcpy(lanes, data, size * sizeof(int));
 
-        for (Buffer* cur = in_arr + 1; cur < in_arr + in_arr_sz; cur++)
-        {
-            if (min->offset == min->size)
-            {
-                min = cur;
-                continue;
-            }
+    __m256i vec = _mm256_loadu_si256((const __m256i*) lanes);
 
-            if (cur->offset < cur->size &&
-                cur->data[cur->offset] < min->data[min->offset])
-            {
-                min = cur;
-            }
-        }
+    NETWORK_LAYER(vec, _mm256_setr_epi32(2, 3, 0, 1, 6, 7, 4, 5), 0xCC);
+    NETWORK_LAYER(vec, _mm256_setr_epi32(4, 5, 6, 7, 0, 1, 2, 3), 0xF0);
+    NETWORK_LAYER(vec, _mm256_setr_epi32(1, 0, 3, 2, 5, 4, 7, 6), 0xAA);
+    NETWORK_LAYER(vec, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7), 0x30);
+    NETWORK_LAYER(vec, _mm256_setr_epi32(0, 4, 2, 6, 1, 5, 3, 7), 0x50);
+    NETWORK_LAYER(vec, _mm256_setr_epi32(0, 2, 1, 4, 3, 6, 5, 7), 0x54);
+
+    _mm256_storeu_si256((__m256i*) lanes, vec);
+    memcpy(data, lanes, size * sizeof(int));
+}
 
-        out->data[out->offset] = min->data[min->offset];
+#undef NETWORK_LAYER
+#else
+static void
+networkSort(int* data, size_t size)
+{
+    insertionSort(data, size);
+}
+#endif
 
-        out->offset++;
-        min->offset++;
-    }
+static void
+siftDown(int* data, size_t root, size_t size)
+{
+    for (size_t child = 2 * root + 1; child < size; child = 2 * root + 1)
+    {
+        if (child + 1 < size && data[child] < data[child + 1])
+            child++;
 
-    return 0;
+        if (data[root] >= data[child])
+            return;
+
+        swapInts(&data[root], &data[child]);
+        root = child;
+    }
 }
 
-static int
-checker(Buffer* raw_buf, Buffer* sorted_buf)
+static void
+heapSort(int* data, size_t size)
 {
-    assert(raw_buf->size == sorted_buf->size);
+    for (size_t i = size / 2; i > 0; i--)
+        siftDown(data, i - 1, size);
+
+    for (size_t i = size; i > 1; i--)
+    {
+        swapInts(&data[0], &data[i - 1]);
+        siftDown(data, 0, i - 1);
+    }
+}
 
-    qsort(raw_buf->data, raw_buf->size, sizeof(int), compareInts);
+/*
+    Quicksort with median of three pivots and Hoare partitioning, falling
+    back to heapsort once depth is exhausted. Leaves up to leaf_sz are
+    finished by insertion sort or by the sorting network.
+*/
+static void
+introSort(int* data, size_t size, size_t depth, int is_network)
+{
+    size_t leaf_sz = is_network ? NETWORK_SZ : INSERTION_MAX_SZ;
 
-    for (size_t i = 0; i < sorted_buf->size; i++)
+    while (size > leaf_sz)
     {
-        if (raw_buf->data[i] != sorted_buf->data[i])
+        if (depth-- == 0)
+        {
+            heapSort(data, size);
+            return;
+        }
+
+        size_t mid = size / 2;
+        if (data[mid] < data[0])
+            swapInts(&data[mid], &data[0]);
+        if (data[size - 1] < data[0])
+            swapInts(&data[size - 1], &data[0]);
+        if (data[size - 1] < data[mid])
+            swapInts(&data[size - 1], &data[mid]);
+
+        int pivot = data[mid];
+        size_t i = 0;
+        size_t j = size - 1;
+
+        for (;;)
+        {
+            while (data[i] < pivot)
+                i++;
+            while (data[j] > pivot)
+                j--;
+
+            if (i >= j)
+                break;
+
+            swapInts(&data[i++], &data[j--]);
+        }
+
+        /* recurse into the smaller part, loop on the greater one */
+        size_t left_sz = j + 1;
+        if (left_sz < size - left_sz)
+        {
+            introSort(data, left_sz, depth, is_network);
+            data += left_sz;
+            size -= left_sz;
+        }
+        else
         {
-            return error("%zu element are different: OK: %d, FAIL: %d",
-                         i, raw_buf->data[i], sorted_buf->data[i]);
+            introSort(data + left_sz, size - left_sz, depth, is_network);
+            size = left_sz;
         }
     }
 
-    return 0;
+    if (is_network)
+        networkSort(data, size);
+    else
+        insertionSort(data, size);
 }
 
-static void
-genData(Buffer* buf)
+/*
+    Element types of the engine. Every type maps to an unsigned key of
+    the same order: signed ints get their sign bit flipped, floats all
+    bits flipped when negative and just the sign bit otherwise, records
+    are ordered by their embedded unsigned key. Kernels are instantiated
+    per type by macros and sort by these keys, so no comparison goes
+    through a function pointer.
+*/
+typedef enum
 {
-    srand((unsigned int) time(NULL));
+    TYPE_INT32,
+    TYPE_INT64,
+    TYPE_FLOAT,
+    TYPE_DOUBLE,
+    TYPE_RECORD16,
+    N_TYPES
+} ElemType;
 
-    for (size_t i = 0; i < buf->size; i++)
-        buf->data[i] = rand() % (int) buf->size;
+static const char* TYPE_NAMES[N_TYPES] = {
+    [TYPE_INT32]    = "int32",
+    [TYPE_INT64]    = "int64",
+    [TYPE_FLOAT]    = "float",
+    [TYPE_DOUBLE]   = "double",
+    [TYPE_RECORD16] = "rec16"
+};
+
+/* 8 byte key, then 8 bytes of payload carried along */
+typedef struct
+{
+    uint64_t key;
+    uint64_t payload;
+} Record16;
+
+static const size_t TYPE_SIZES[N_TYPES] = {
+    [TYPE_INT32]    = sizeof(int32_t),
+    [TYPE_INT64]    = sizeof(int64_t),
+    [TYPE_FLOAT]    = sizeof(float),
+    [TYPE_DOUBLE]   = sizeof(double),
+    [TYPE_RECORD16] = sizeof(Record16)
+};
+
+static inline uint64_t
+intKey(int value)
+{
+    return (uint32_t) value ^ 0x80000000u;
 }
 
-int
-main(int argc, char* argv[])
+static inline uint64_t
+keyInt32(const int* elem)
 {
-    PROGNAME = argv[0];
+    return intKey(*elem);
+}
 
-    if (argc != 3)
-        return error("Wrong amount of parameters\n");
+static inline uint64_t
+keyInt64(const int64_t* elem)
+{
+    return (uint64_t) *elem ^ 0x8000000000000000ull;
+}
 
-    size_t data_sz = (size_t) atoi(argv[1]);
-    size_t n_threads = (size_t) atoi(argv[2]);
+static inline uint64_t
+keyFloat(const float* elem)
+{
+    uint32_t bits = 0;
+    memcpy(&bits, elem, sizeof(bits));
 
-    /* generate data */
-    Buffer init_data = {
-        .data = (int*) malloc(data_sz * sizeof(int)),
-        .size = data_sz
-    };
-    if (!init_data.data)
-        return error("cannot allocate memory");
+    return bits ^ (bits >> 31 ? 0xFFFFFFFFu : 0x80000000u);
+}
 
-    genData(&init_data);
-    $DBG("initial data");
-    printBuffer(&init_data);
+static inline uint64_t
+keyDouble(const double* elem)
+{
+    uint64_t bits = 0;
+    memcpy(&bits, elem, sizeof(bits));
 
-    /* create sorters */
-    pthread_t* sorter_tids = (pthread_t*) malloc(n_threads * sizeof(pthread_t));
-    Buffer* sorter_bufs = (Buffer*) malloc(n_threads * sizeof(Buffer));
-    if (!sorter_bufs)
-        return error("cannot allocate memory");
+    return bits ^ (bits >> 63 ? 0xFFFFFFFFFFFFFFFFull : 0x8000000000000000ull);
+}
 
-    size_t sorter_sz = data_sz / n_threads;
-    size_t tail_sz = data_sz % n_threads;
+static inline uint64_t
+keyRecord16(const Record16* elem)
+{
+    return elem->key;
+}
 
-    $DBG("starting sorters");
-    int* sorter_ptr = init_data.data;
-    for (size_t i = 0; i < n_threads; i++)
-    {
-        size_t tmp_sz = sorter_sz;
-        if (i < tail_sz)
-            tmp_sz++;
- 
-        sorter_bufs[i].data = (int*) malloc(tmp_sz * sizeof(int));
-        sorter_bufs[i].size = tmp_sz;
-        sorter_bufs[i].offset = 0;
-        memcpy(sorter_bufs[i].data, sorter_ptr, tmp_sz * sizeof(int));
-        sorter_ptr += tmp_sz;
+/*
+    LSD radix sort by key bytes. All histograms are counted in one pass,
+    passes whose digit is the same for every element are skipped.
+    scratch holds size elements.
+*/
+#define DEFINE_RADIX_SORT(NAME, TYPE, KEY, KEY_SZ)                              \
+static int                                                                      \
+radixSort##NAME(TYPE* data, size_t size, TYPE* scratch)                         \
+{                                                                               \
+    size_t* counts = (size_t*) calloc((KEY_SZ) * 256, sizeof(size_t));         \
+    if (!counts)                                                                \
+        return -1;                                                              \
+                                                                                \
+    for (size_t i = 0; i < size; i++)                                           \
+    {                                                                           \
+        uint64_t key = KEY(&data[i]);                                           \
+                                                                                \
+        for (size_t digit = 0; digit < (KEY_SZ); digit++)                       \
+            counts[digit * 256 + ((key >> (8 * digit)) & 0xFF)]++;              \
+    }                                                                           \
+                                                                                \
+    TYPE* src = data;                                                           \
+    TYPE* dst = scratch;                                                        \
+                                                                                \
+    for (size_t digit = 0; digit < (KEY_SZ) && size > 0; digit++)               \
+    {                                                                           \
+        size_t* offsets = counts + digit * 256;                                 \
+        uint64_t shift = 8 * digit;                                             \
+                                                                                \
+        if (offsets[(KEY(&src[0]) >> shift) & 0xFF] == size)                    \
+            continue;                                                           \
+                                                                                \
+        size_t sum = 0;                                                         \
+        for (size_t bucket = 0; bucket < 256; bucket++)                         \
+        {                                                                       \
+            size_t count = offsets[bucket];                                     \
+            offsets[bucket] = sum;                                              \
+            sum += count;                                                       \
+        }                                                                       \
+                                                                                \
+        for (size_t i = 0; i < size; i++)                                       \
+            dst[offsets[(KEY(&src[i]) >> shift) & 0xFF]++] = src[i];            \
+                                                                                \
+        TYPE* tmp = src;                                                        \
+        src = dst;                                                              \
+        dst = tmp;                                                              \
+    }                                                                           \
+                                                                                \
+    if (src != data)                                                            \
+        memcpy(data, src, size * sizeof(TYPE));                                 \
+                                                                                \
+    free(counts);                                                               \
+                                                                                \
+    return 0;                                                                   \
+}
+
+DEFINE_RADIX_SORT(Int32,    int,      keyInt32,    sizeof(int32_t))
+DEFINE_RADIX_SORT(Int64,    int64_t,  keyInt64,    sizeof(int64_t))
+DEFINE_RADIX_SORT(Float,    float,    keyFloat,    sizeof(float))
+DEFINE_RADIX_SORT(Double,   double,   keyDouble,   sizeof(double))
+DEFINE_RADIX_SORT(Record16, Record16, keyRecord16, sizeof(uint64_t))
 
-        pthread_create(&sorter_tids[i], NULL, sorterStart, &sorter_bufs[i]); 
+#undef DEFINE_RADIX_SORT
+
+/* Key of an element of type in a byte buffer, for merging runs of any type */
+static inline uint64_t
+elemKey(const char* elem, ElemType type)
+{
+    switch (type)
+    {
+        case TYPE_INT32:
+        {
+            int value = 0;
+            memcpy(&value, elem, sizeof(value));
+            return keyInt32(&value);
+        }
+        case TYPE_INT64:
+        {
+            int64_t value = 0;
+            memcpy(&value, elem, sizeof(value));
+            return keyInt64(&value);
+        }
+        case TYPE_FLOAT:
+        {
+            float value = 0;
+            memcpy(&value, elem, sizeof(value));
+            return keyFloat(&value);
+        }
+        case TYPE_DOUBLE:
+        {
+            double value = 0;
+            memcpy(&value, elem, sizeof(value));
+            return keyDouble(&value);
+        }
+        case TYPE_RECORD16:
+        {
+            Record16 value = {};
+            memcpy(&value, elem, sizeof(value));
+            return keyRecord16(&value);
+        }
+        case N_TYPES:
+        default:
+            assert(0 && "unknown element type");
+            return 0;
     }
+}
 
-    $DBG("joining sorters");
-    for (size_t i = 0; i < n_threads; i++)
+static size_t
+introDepth(size_t size)
+{
+    size_t depth = 0;
+    for (; size > 1; size >>= 1)
+        depth += 2;
+
+    return depth;
+}
+
+static int
+sorter(Buffer* buf, int* scratch, SortKernel kernel)
+{
+    $DBG("%s, size %zu", KERNEL_NAMES[kernel], buf->size);
+
+    if (kernel == KERNEL_AUTO)
+        kernel = buf->size >= RADIX_MIN_SZ ? KERNEL_RADIX : KERNEL_NETWORK;
+
+    if (buf->size == 0)
+        return 0;
+
+    switch (kernel)
     {
-        void* thread_retval = NULL;
-        pthread_join(sorter_tids[i], &thread_retval);
+        case KERNEL_QSORT:
+            qsort(buf->data, buf->size, sizeof(int), compareInts);
+            break;
+
+        case KERNEL_RADIX:
+            if (radixSortInt32(buf->data, buf->size, scratch) == 0)
+                break;
+
+            $DBG("no memory for radix counts, falling back to introsort");
+            introSort(buf->data, buf->size, introDepth(buf->size), 1);
+            break;
+
+        case KERNEL_INTRO:
+        case KERNEL_NETWORK:
+            introSort(buf->data, buf->size, introDepth(buf->size),
+                      kernel == KERNEL_NETWORK);
+            break;
+
+        case KERNEL_AUTO:
+        case N_KERNELS:
+        default:
+            assert(0 && "unknown sort kernel");
     }
 
+    return 0;
+}
+
+typedef struct
+{
+    Buffer*    buf;
+    int*       scratch;
+    SortKernel kernel;
+} SorterArgs;
+
+static void*
+sorterStart(void* arg_ptr)
+{
+    $DBG("sorter started, stack: %p", &arg_ptr);
+    SorterArgs* ptr = (SorterArgs*) arg_ptr;
+
+    sorter(ptr->buf, ptr->scratch, ptr->kernel);
+
+    $DBG("sorter returning");
+    return NULL;
+}
+
 /*
-    for (size_t i = 0; i < n_threads; i++)
-        printBuffer(&sorter_bufs[i]);
+    Loser tree over k runs: every internal node keeps the loser of the
+    match played there, tree[0] keeps the overall winner. Taking the
+    minimum is one replay from a leaf to the root, log2(k) comparisons
+    instead of k. The tree plays on order preserving unsigned keys of the
+    run heads, so in-memory and file runs share it; the caller refreshes
+    the key of the winner (or marks its run empty) before replaying.
+    Empty runs lose every match.
 */
+typedef struct
+{
+    size_t    n_leaves;
+    size_t*   tree;
+    uint64_t* keys;
+    char*     is_empty;
+    size_t    n_runs;
+} LoserTree;
 
-    /* merge sorters' data */
-    Buffer merged_data = {
-        .data = (int*) malloc(data_sz * sizeof(int)),
-        .size = data_sz
-    };
-    if (!merged_data.data)
-        return error("cannot allocate memory");
+static inline int
+loserTreeLess(const LoserTree* lt, size_t a, size_t b)
+{
+    if (a >= lt->n_runs || lt->is_empty[a])
+        return 0;
 
-    $DBG("merger");
-    merger(&merged_data, sorter_bufs, n_threads);
-    printBuffer(&merged_data);
+    if (b >= lt->n_runs || lt->is_empty[b])
+        return 1;
 
-    /* check data */
-    $DBG("checker");
-    checker(&init_data, &merged_data);
+    return lt->keys[a] < lt->keys[b];
+}
 
-    /* cleanup */
-    free(init_data.data);
-    free(merged_data.data);
-    for (size_t i = 0; i < n_threads; i++)
-        free(sorter_bufs[i].data);
+/* Plays the subtree of node, returns its winner */
+static size_t
+loserTreeBuild(LoserTree* lt, size_t node)
+{
+    if (node >= lt->n_leaves)
+        return node - lt->n_leaves;
 
-    free(sorter_bufs);
-    free(sorter_tids);
+    size_t left  = loserTreeBuild(lt, 2 * node);
+    size_t right = loserTreeBuild(lt, 2 * node + 1);
 
-    $DBG("main returning");
+    if (loserTreeLess(lt, right, left))
+    {
+        lt->tree[node] = left;
+        return right;
+    }
 
-    return 0;
+    lt->tree[node] = right;
+    return left;
+}
+
+/* Keys and is_empty are left for the caller to fill before loserTreeInit() */
+static int
+loserTreeCtor(LoserTree* lt, size_t n_runs)
+{
+    lt->n_leaves = 1;
+    while (lt->n_leaves < n_runs)
+        lt->n_leaves <<= 1;
+
+    lt->n_runs   = n_runs;
+    lt->tree     = (size_t*)   malloc(lt->n_leaves * sizeof(size_t));
+    lt->keys     = (uint64_t*) calloc(n_runs + 1, sizeof(uint64_t));
+    lt->is_empty = (char*)     calloc(n_runs + 1, sizeof(char));
+    if (!lt->tree || !lt->keys || !lt->is_empty)
+        return -1;
+
+    return 0;
+}
+
+static void
+loserTreeDtor(LoserTree* lt)
+{
+    free(lt->tree);
+    free(lt->keys);
+    free(lt->is_empty);
+}
+
+static void
+loserTreeInit(LoserTree* lt)
+{
+    lt->tree[0] = loserTreeBuild(lt, 1);
+}
+
+static inline size_t
+loserTreeWinner(const LoserTree* lt)
+{
+    return lt->tree[0];
+}
+
+static inline void
+loserTreeReplay(LoserTree* lt)
+{
+    size_t winner = lt->tree[0];
+
+    for (size_t node = (winner + lt->n_leaves) / 2; node > 0; node /= 2)
+    {
+        if (loserTreeLess(lt, lt->tree[node], winner))
+        {
+            size_t tmp = lt->tree[node];
+            lt->tree[node] = winner;
+            winner = tmp;
+        }
+    }
+
+    lt->tree[0] = winner;
+}
+
+/*
+    Fills out from its offset to its size with the smallest elements of
+    in_arr, each of which is sorted from its offset on.
+*/
+static int
+merger(Buffer* out, Buffer* in_arr, size_t in_arr_sz)
+{
+    LoserTree lt = {};
+    if (loserTreeCtor(&lt, in_arr_sz) != 0)
+    {
+        loserTreeDtor(&lt);
+        return error("cannot allocate memory\n");
+    }
+
+    for (size_t i = 0; i < in_arr_sz; i++)
+    {
+        lt.is_empty[i] = in_arr[i].offset == in_arr[i].size;
+        if (!lt.is_empty[i])
+            lt.keys[i] = intKey(in_arr[i].data[in_arr[i].offset]);
+    }
+
+    loserTreeInit(&lt);
+
+    while (out->offset < out->size)
+    {
+        size_t winner = loserTreeWinner(&lt);
+        Buffer* run = &in_arr[winner];
+
+        out->data[out->offset++] = run->data[run->offset++];
+
+        if (run->offset == run->size)
+            lt.is_empty[winner] = 1;
+        else
+            lt.keys[winner] = intKey(run->data[run->offset]);
+
+        loserTreeReplay(&lt);
+    }
+
+    loserTreeDtor(&lt);
+
+    return 0;
+}
+
+/* Number of elements of sorted buf less than value (or_equal: not greater) */
+static size_t
+lowerBound(const Buffer* buf, int64_t value, int or_equal)
+{
+    size_t lo = 0;
+    size_t hi = buf->size;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (buf->data[mid] < value || (or_equal && buf->data[mid] == value))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+    Co-ranking of k sorted runs: finds splits[i] such that the first
+    splits[i] elements of every run together are the `rank` smallest
+    ones. The rank-th value is found by binary search over the values,
+    then its duplicates are dealt to runs in order. This is merge path
+    partitioning generalized to more than two inputs.
+*/
+static void
+coRank(const Buffer* runs, size_t n_runs, size_t rank, size_t* splits)
+{
+    int64_t lo = INT32_MAX;
+    int64_t hi = INT32_MIN;
+
+    for (size_t i = 0; i < n_runs; i++)
+    {
+        if (runs[i].size == 0)
+            continue;
+
+        if (runs[i].data[0] < lo)
+            lo = runs[i].data[0];
+        if (runs[i].data[runs[i].size - 1] > hi)
+            hi = runs[i].data[runs[i].size - 1];
+    }
+
+    /* smallest value with more than `rank` elements not greater than it */
+    while (lo < hi)
+    {
+        int64_t mid = lo + (hi - lo) / 2;
+
+        size_t n_not_greater = 0;
+        for (size_t i = 0; i < n_runs; i++)
+            n_not_greater += lowerBound(&runs[i], mid, 1);
+
+        if (n_not_greater > rank)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    size_t n_taken = 0;
+    for (size_t i = 0; i < n_runs; i++)
+    {
+        splits[i] = lowerBound(&runs[i], lo, 0);
+        n_taken += splits[i];
+    }
+
+    for (size_t i = 0; i < n_runs && n_taken < rank; i++)
+    {
+        size_t n_equal = lowerBound(&runs[i], lo, 1) - splits[i];
+        if (n_equal > rank - n_taken)
+            n_equal = rank - n_taken;
+
+        splits[i] += n_equal;
+        n_taken   += n_equal;
+    }
+}
+
+typedef struct
+{
+    Buffer  out;
+    Buffer* in_arr;
+    size_t  in_arr_sz;
+} MergerArgs;
+
+static void*
+mergerStart(void* arg_ptr)
+{
+    $DBG("merger started, stack: %p", &arg_ptr);
+    MergerArgs* ptr = (MergerArgs*) arg_ptr;
+
+    merger(&ptr->out, ptr->in_arr, ptr->in_arr_sz);
+
+    $DBG("merger returning");
+    return NULL;
+}
+
+/*
+    Splits the output into n_mergers equal ranges, co-ranks the runs at
+    every boundary and merges the ranges independently, each on its own
+    thread with its own loser tree.
+*/
+static int
+parallelMerger(Buffer* out, Buffer* in_arr, size_t in_arr_sz, size_t n_mergers,
+               const CpuPlacement* placement)
+{
+    int retval = 0;
+    size_t n_started = 0;
+
+    pthread_t*  merger_tids = (pthread_t*)  calloc(n_mergers, sizeof(pthread_t));
+    MergerArgs* merger_args = (MergerArgs*) calloc(n_mergers, sizeof(MergerArgs));
+    Buffer*     views       = (Buffer*)     calloc(n_mergers * in_arr_sz, sizeof(Buffer));
+    size_t*     splits      = (size_t*)     calloc((n_mergers + 1) * in_arr_sz, sizeof(size_t));
+    if (!merger_tids || !merger_args || !views || !splits)
+    {
+        retval = error("cannot allocate memory\n");
+        goto finally;
+    }
+
+    for (size_t i = 0; i <= n_mergers; i++)
+        coRank(in_arr, in_arr_sz, out->size * i / n_mergers, splits + i * in_arr_sz);
+
+    for (; n_started < n_mergers; n_started++)
+    {
+        size_t i  = n_started;
+        size_t lo = out->size * i / n_mergers;
+        size_t hi = out->size * (i + 1) / n_mergers;
+
+        for (size_t run = 0; run < in_arr_sz; run++)
+        {
+            size_t first = splits[i * in_arr_sz + run];
+            size_t last  = splits[(i + 1) * in_arr_sz + run];
+
+            views[i * in_arr_sz + run] = (Buffer) {
+                .data = in_arr[run].data + first,
+                .size = last - first
+            };
+        }
+
+        merger_args[i] = (MergerArgs) {
+            .out       = {.data = out->data + lo, .size = hi - lo},
+            .in_arr    = views + i * in_arr_sz,
+            .in_arr_sz = in_arr_sz
+        };
+
+        int err = startThread(&merger_tids[i], placement, i, mergerStart, &merger_args[i]);
+        if (err != 0)
+        {
+            retval = error("cannot start merger: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < n_started; i++)
+        pthread_join(merger_tids[i], NULL);
+
+finally:
+    free(merger_tids);
+    free(merger_args);
+    free(views);
+    free(splits);
+
+    return retval;
+}
+
+/* Order-independent fingerprint of the elements: sum of their hashes */
+static uint64_t
+checksum(const Buffer* buf)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < buf->size; i++)
+    {
+        uint64_t hash = (uint32_t) buf->data[i] + 0x9E3779B97F4A7C15ull;
+        hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+        hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+        sum += hash ^ (hash >> 31);
+    }
+
+    return sum;
+}
+
+/*
+    Sorted data is a permutation of the raw data if it is ordered and has
+    the raw checksum, so the raw copy need not be kept around.
+*/
+static int
+checker(uint64_t raw_checksum, Buffer* sorted_buf)
+{
+    for (size_t i = 1; i < sorted_buf->size; i++)
+    {
+        if (sorted_buf->data[i - 1] > sorted_buf->data[i])
+        {
+            return error("%zu element is out of order: %d > %d\n",
+                         i, sorted_buf->data[i - 1], sorted_buf->data[i]);
+        }
+    }
+
+    if (checksum(sorted_buf) != raw_checksum)
+        return error("checksum mismatch, elements were lost or changed\n");
+
+    return 0;
+}
+
+typedef enum
+{
+    DIST_UNIFORM,
+    DIST_SORTED,
+    DIST_REVERSE,
+    DIST_FEW_UNIQUE,
+    DIST_ZIPF,
+    N_DISTS
+} Distribution;
+
+static const char* DIST_NAMES[N_DISTS] = {
+    [DIST_UNIFORM]    = "uniform",
+    [DIST_SORTED]     = "sorted",
+    [DIST_REVERSE]    = "reverse",
+    [DIST_FEW_UNIQUE] = "few-unique",
+    [DIST_ZIPF]       = "zipf"
+};
+
+static const int FEW_UNIQUE_VALUES = 16;
+
+/*
+    Element index of the splitmix64 stream of seed. Seeds are reproducible
+    across runs and libcs, and slices can be generated in parallel.
+*/
+static inline uint64_t
+randomAt(uint64_t seed, size_t index)
+{
+    uint64_t value = seed + (index + 1) * 0x9E3779B97F4A7C15ull;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+    return value ^ (value >> 31);
+}
+
+/* Fills elements lo to hi of buf */
+static void
+genData(Buffer* buf, size_t lo, size_t hi, Distribution dist, uint64_t seed)
+{
+    double log_size = log((double) buf->size + 1);
+
+    for (size_t i = lo; i < hi; i++)
+    {
+        uint64_t random = randomAt(seed, i);
+
+        switch (dist)
+        {
+            case DIST_UNIFORM:
+                buf->data[i] = (int) (int32_t) (uint32_t) random;
+                break;
+            case DIST_SORTED:
+                buf->data[i] = (int) i;
+                break;
+            case DIST_REVERSE:
+                buf->data[i] = (int) (buf->size - i);
+                break;
+            case DIST_FEW_UNIQUE:
+                buf->data[i] = (int) (random % (uint64_t) FEW_UNIQUE_VALUES);
+                break;
+            case DIST_ZIPF:
+            {
+                /* rank r with probability about 1/r: size^u for uniform u */
+                double u = (double) (random >> 11) / (double) (1ull << 53);
+                buf->data[i] = (int) (exp(u * log_size) - 1);
+                break;
+            }
+            case N_DISTS:
+            default:
+                assert(0 && "unknown distribution");
+        }
+    }
+}
+
+typedef enum
+{
+    MODE_MERGE,
+    MODE_SAMPLE
+} SortMode;
+
+typedef enum
+{
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON
+} ReportFormat;
+
+typedef enum
+{
+    PHASE_GEN,
+    PHASE_SAMPLE,
+    PHASE_SORT,
+    PHASE_MERGE,
+    PHASE_CHECK,
+    N_PHASES
+} Phase;
+
+static const char* PHASE_NAMES[N_PHASES] = {
+    [PHASE_GEN]    = "gen",
+    [PHASE_SAMPLE] = "sample",
+    [PHASE_SORT]   = "sort",
+    [PHASE_MERGE]  = "merge",
+    [PHASE_CHECK]  = "check"
+};
+
+typedef struct
+{
+    size_t       data_sz;
+    size_t       n_threads;
+    SortMode     mode;
+    SortKernel   kernel;
+    Distribution dist;
+    uint64_t     seed;
+    size_t       n_reps;
+    ReportFormat format;
+    int          is_timing;
+    int          is_printing;
+    CpuPlacement placement;
+    const char*  input_path;
+    const char*  output_path;
+    ElemType     type;
+    size_t       width;
+    size_t       mem_budget;
+} Args;
+
+static const size_t EXT_DEFAULT_BUDGET = 256 << 20;
+
+static int
+parseSize(const char* str, size_t* size)
+{
+    char* end = NULL;
+
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno != 0 || end == str)
+        return 1;
+
+    switch (*end)
+    {
+        case 'G': value <<= 10; /* fall through */
+        case 'M': value <<= 10; /* fall through */
+        case 'K': value <<= 10; end++; break;
+        default: break;
+    }
+
+    if (*end != '\0' || value == 0 || value > (1ull << 40))
+        return 1;
+
+    *size = (size_t) value;
+
+    return 0;
+}
+
+static int
+parseArgs(int argc, char* argv[], Args* args)
+{
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "i:o:w:T:M:k:m:d:s:r:f:C:pt")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                args->dist = N_DISTS;
+                for (size_t i = 0; i < N_DISTS; i++)
+                {
+                    if (strcmp(optarg, DIST_NAMES[i]) == 0)
+                        args->dist = (Distribution) i;
+                }
+
+                if (args->dist == N_DISTS)
+                    return error("unknown distribution '%s'\n", optarg);
+                break;
+            case 's':
+                args->seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'r':
+                args->n_reps = (size_t) atoi(optarg);
+                args->is_timing = 1;
+                if (args->n_reps == 0)
+                    return error("invalid number of repetitions '%s'\n", optarg);
+                break;
+            case 'f':
+                if (strcmp(optarg, "text") == 0)
+                    args->format = FORMAT_TEXT;
+                else if (strcmp(optarg, "csv") == 0)
+                    args->format = FORMAT_CSV;
+                else if (strcmp(optarg, "json") == 0)
+                    args->format = FORMAT_JSON;
+                else
+                    return error("unknown report format '%s'\n", optarg);
+                args->is_timing = 1;
+                break;
+            case 'p':
+                args->is_printing = 1;
+                break;
+            case 'C':
+                cpuPlacementDtor(&args->placement);
+                if (cpuPlacementCtor(&args->placement, optarg) != 0)
+                    return 1;
+                break;
+            case 'i':
+                args->input_path = optarg;
+                break;
+            case 'o':
+                args->output_path = optarg;
+                break;
+            case 'w':
+                if (strcmp(optarg, "32") == 0)
+                    args->type = TYPE_INT32;
+                else if (strcmp(optarg, "64") == 0)
+                    args->type = TYPE_INT64;
+                else
+                    return error("invalid element width '%s', 32 or 64\n", optarg);
+                break;
+            case 'T':
+                args->type = N_TYPES;
+                for (size_t i = 0; i < N_TYPES; i++)
+                {
+                    if (strcmp(optarg, TYPE_NAMES[i]) == 0)
+                        args->type = (ElemType) i;
+                }
+
+                if (args->type == N_TYPES)
+                    return error("unknown element type '%s'\n", optarg);
+                break;
+            case 'M':
+                if (parseSize(optarg, &args->mem_budget) != 0)
+                    return error("invalid memory budget '%s'\n", optarg);
+                break;
+            case 'm':
+                if (strcmp(optarg, "merge") == 0)
+                    args->mode = MODE_MERGE;
+                else if (strcmp(optarg, "sample") == 0)
+                    args->mode = MODE_SAMPLE;
+                else
+                    return error("unknown sort mode '%s'\n", optarg);
+                break;
+            case 'k':
+                args->kernel = N_KERNELS;
+                for (size_t i = 0; i < N_KERNELS; i++)
+                {
+                    if (strcmp(optarg, KERNEL_NAMES[i]) == 0)
+                        args->kernel = (SortKernel) i;
+                }
+
+                if (args->kernel == N_KERNELS)
+                    return error("unknown sort kernel '%s'\n", optarg);
+                break;
+            case 't':
+                args->is_timing = 1;
+                break;
+            case '?':
+            default:
+                return 1;
+        }
+    }
+
+    args->width = TYPE_SIZES[args->type];
+
+    if (args->n_reps == 0)
+        args->n_reps = 1;
+
+    if (args->seed == 0)
+        args->seed = 1;
+
+    if (args->mem_budget == 0)
+        args->mem_budget = EXT_DEFAULT_BUDGET;
+
+    /* files to sort replace data_sz */
+    if (args->input_path)
+    {
+        if (!args->output_path)
+            return error("-i needs an output file, -o\n");
+
+        if (argc - optind != 1)
+            return error("usage: %s -i input -o output [-T int32|int64|float|double|rec16]\n"
+                         "    [-w 32|64] [-M budget] [-k kernel]\n"
+                         "    [-C compact|scatter|cpu_list] [-t] [-r reps] [-f text|csv|json]\n"
+                         "    n_threads\n", PROGNAME);
+
+        args->n_threads = (size_t) atoi(argv[optind]);
+    }
+    else
+    {
+        if (argc - optind != 2)
+            return error("usage: %s [-m merge|sample] [-k auto|qsort|intro|network|radix]\n"
+                         "    [-d uniform|sorted|reverse|few-unique|zipf] [-s seed] [-p]\n"
+                         "    [-C compact|scatter|cpu_list] [-t] [-r reps] [-f text|csv|json]\n"
+                         "    data_sz n_threads\n", PROGNAME);
+
+        args->data_sz   = (size_t) atoi(argv[optind]);
+        args->n_threads = (size_t) atoi(argv[optind + 1]);
+    }
+
+    if (args->n_threads == 0)
+        return error("invalid number of threads '%s'\n", argv[argc - 1]);
+
+    return 0;
+}
+
+static double
+nowMs(void)
+{
+    struct timespec ts = {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec * 1e3 + (double) ts.tv_nsec / 1e6;
+}
+
+/*
+    Sorters work in place on disjoint slices of data, each radix sort uses
+    the matching slice of scratch, then the slices are merged into scratch.
+*/
+static int
+mergeSort(Buffer* data, int* scratch, const Args* args, double* phase_ms)
+{
+    int retval = 0;
+    size_t n_threads = args->n_threads;
+    size_t n_started = 0;
+
+    pthread_t* sorter_tids = (pthread_t*) malloc(n_threads * sizeof(pthread_t));
+    Buffer* sorter_bufs = (Buffer*) malloc(n_threads * sizeof(Buffer));
+    SorterArgs* sorter_args = (SorterArgs*) malloc(n_threads * sizeof(SorterArgs));
+    if (!sorter_tids || !sorter_bufs || !sorter_args)
+    {
+        retval = error("cannot allocate memory\n");
+        goto finally;
+    }
+
+    $DBG("starting sorters");
+    double sort_start = nowMs();
+    for (; n_started < n_threads; n_started++)
+    {
+        size_t i = n_started;
+
+        /* the slice genData() wrote on the same CPU */
+        size_t lo = data->size * i / n_threads;
+        size_t hi = data->size * (i + 1) / n_threads;
+
+        sorter_bufs[i] = (Buffer) {
+            .data = data->data + lo,
+            .size = hi - lo
+        };
+
+        sorter_args[i] = (SorterArgs) {
+            .buf     = &sorter_bufs[i],
+            .scratch = scratch + lo,
+            .kernel  = args->kernel
+        };
+
+        int err = startThread(&sorter_tids[i], &args->placement, i, sorterStart, &sorter_args[i]);
+        if (err != 0)
+        {
+            retval = error("cannot start sorter: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    $DBG("joining sorters");
+    for (size_t i = 0; i < n_started; i++)
+    {
+        void* thread_retval = NULL;
+        pthread_join(sorter_tids[i], &thread_retval);
+    }
+
+    if (retval != 0)
+        goto finally;
+
+    phase_ms[PHASE_SORT] = nowMs() - sort_start;
+
+/*
+    for (size_t i = 0; i < n_threads; i++)
+        printBuffer(&sorter_bufs[i]);
+*/
+
+    /* merge sorters' data */
+    Buffer merged_data = {
+        .data = scratch,
+        .size = data->size
+    };
+
+    $DBG("merger");
+    double merge_start = nowMs();
+    retval = parallelMerger(&merged_data, sorter_bufs, n_threads, n_threads, &args->placement);
+
+    phase_ms[PHASE_MERGE] = nowMs() - merge_start;
+
+finally:
+    free(sorter_tids);
+    free(sorter_bufs);
+    free(sorter_args);
+
+    return retval;
+}
+
+/*
+    Sample sort: splitters picked from a random sample cut the value range
+    into one bucket per thread. Every thread counts how many elements of
+    its slice fall into each bucket, scatters the slice into scratch at
+    the offsets those counts give, and sorts one bucket in place. Buckets
+    are ordered, so no merge is needed.
+*/
+static const size_t SAMPLE_OVERSAMPLING = 32;
+
+typedef struct
+{
+    Buffer            data;
+    int*              out;
+    SortKernel        kernel;
+    size_t            n_threads;
+    int*              splitters;    /* n_threads - 1 of them */
+    size_t*           offsets;      /* [thread][bucket] counts, then offsets */
+    size_t*           bucket_los;   /* n_threads + 1 bucket bounds in out */
+    pthread_barrier_t barrier;
+
+    /* start gate: the barrier only opens once every sorter is running */
+    pthread_mutex_t   lock;
+    pthread_cond_t    gate;
+    int               is_go;
+    int               is_aborted;
+} SampleSort;
+
+typedef struct
+{
+    SampleSort* ctx;
+    size_t      id;
+} SampleSorterArgs;
+
+/* Number of splitters not greater than value */
+static inline size_t
+sampleBucket(const SampleSort* ctx, int value)
+{
+    size_t lo = 0;
+    size_t hi = ctx->n_threads - 1;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ctx->splitters[mid] <= value)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static void*
+sampleSorterStart(void* arg_ptr)
+{
+    $DBG("sample sorter started, stack: %p", &arg_ptr);
+    SampleSorterArgs* ptr = (SampleSorterArgs*) arg_ptr;
+    SampleSort* ctx = ptr->ctx;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!ctx->is_go && !ctx->is_aborted)
+        pthread_cond_wait(&ctx->gate, &ctx->lock);
+    int is_aborted = ctx->is_aborted;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (is_aborted)
+        return NULL;
+
+    size_t n_threads = ctx->n_threads;
+    size_t* offsets = ctx->offsets + ptr->id * n_threads;
+
+    const int* slice = ctx->data.data + ctx->data.size * ptr->id / n_threads;
+    size_t slice_sz = ctx->data.size * (ptr->id + 1) / n_threads
+                    - ctx->data.size * ptr->id / n_threads;
+
+    for (size_t i = 0; i < slice_sz; i++)
+        offsets[sampleBucket(ctx, slice[i])]++;
+
+    if (pthread_barrier_wait(&ctx->barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+        /* bucket by bucket, thread by thread */
+        size_t sum = 0;
+        for (size_t bucket = 0; bucket < n_threads; bucket++)
+        {
+            ctx->bucket_los[bucket] = sum;
+
+            for (size_t thread = 0; thread < n_threads; thread++)
+            {
+                size_t count = ctx->offsets[thread * n_threads + bucket];
+                ctx->offsets[thread * n_threads + bucket] = sum;
+                sum += count;
+            }
+        }
+
+        ctx->bucket_los[n_threads] = sum;
+    }
+
+    pthread_barrier_wait(&ctx->barrier);
+
+    for (size_t i = 0; i < slice_sz; i++)
+        ctx->out[offsets[sampleBucket(ctx, slice[i])]++] = slice[i];
+
+    pthread_barrier_wait(&ctx->barrier);
+
+    /* the input is free now, the bucket's slice of it is radix scratch */
+    size_t lo = ctx->bucket_los[ptr->id];
+    Buffer bucket = {
+        .data = ctx->out + lo,
+        .size = ctx->bucket_los[ptr->id + 1] - lo
+    };
+
+    sorter(&bucket, ctx->data.data + lo, ctx->kernel);
+
+    $DBG("sample sorter returning");
+    return NULL;
+}
+
+static int
+sampleSort(Buffer* data, int* scratch, const Args* args, double* phase_ms)
+{
+    int retval = 0;
+    size_t n_threads = args->n_threads;
+    size_t n_started = 0;
+    int is_barrier = 0;
+
+    SampleSort ctx = {
+        .data      = *data,
+        .out       = scratch,
+        .kernel    = args->kernel,
+        .n_threads = n_threads,
+        .lock      = PTHREAD_MUTEX_INITIALIZER,
+        .gate      = PTHREAD_COND_INITIALIZER
+    };
+
+    size_t n_samples = n_threads * SAMPLE_OVERSAMPLING;
+    int* samples = (int*) malloc(n_samples * sizeof(int));
+    pthread_t* sorter_tids = (pthread_t*) malloc(n_threads * sizeof(pthread_t));
+    SampleSorterArgs* sorter_args = (SampleSorterArgs*) malloc(n_threads * sizeof(SampleSorterArgs));
+    ctx.splitters  = (int*) malloc(n_threads * sizeof(int));
+    ctx.offsets    = (size_t*) calloc(n_threads * n_threads, sizeof(size_t));
+    ctx.bucket_los = (size_t*) malloc((n_threads + 1) * sizeof(size_t));
+    if (!samples || !sorter_tids || !sorter_args || !ctx.splitters ||
+        !ctx.offsets || !ctx.bucket_los)
+    {
+        retval = error("cannot allocate memory\n");
+        goto finally;
+    }
+
+    double sample_start = nowMs();
+
+    unsigned int seed = 1;
+    for (size_t i = 0; i < n_samples; i++)
+    {
+        size_t index = data->size ? (size_t) rand_r(&seed) % data->size : 0;
+        samples[i] = data->size ? data->data[index] : 0;
+    }
+
+    introSort(samples, n_samples, introDepth(n_samples), 1);
+
+    for (size_t i = 0; i + 1 < n_threads; i++)
+        ctx.splitters[i] = samples[(i + 1) * SAMPLE_OVERSAMPLING];
+
+    phase_ms[PHASE_SAMPLE] = nowMs() - sample_start;
+
+    int err = pthread_barrier_init(&ctx.barrier, NULL, (unsigned int) n_threads);
+    if (err != 0)
+    {
+        retval = error("cannot create barrier: %s\n", strerror(err));
+        goto finally;
+    }
+    is_barrier = 1;
+
+    $DBG("starting sample sorters");
+    double sort_start = nowMs();
+    for (; n_started < n_threads; n_started++)
+    {
+        sorter_args[n_started] = (SampleSorterArgs) {.ctx = &ctx, .id = n_started};
+
+        err = startThread(&sorter_tids[n_started], &args->placement, n_started,
+                          sampleSorterStart, &sorter_args[n_started]);
+        if (err != 0)
+        {
+            retval = error("cannot start sorter: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    /* with a sorter missing the barrier would never open, so call off the rest */
+    pthread_mutex_lock(&ctx.lock);
+    if (retval == 0)
+        ctx.is_go = 1;
+    else
+        ctx.is_aborted = 1;
+    pthread_cond_broadcast(&ctx.gate);
+    pthread_mutex_unlock(&ctx.lock);
+
+    $DBG("joining sample sorters");
+    for (size_t i = 0; i < n_started; i++)
+        pthread_join(sorter_tids[i], NULL);
+
+    if (retval != 0)
+        goto finally;
+
+    phase_ms[PHASE_SORT] = nowMs() - sort_start;
+
+finally:
+    if (is_barrier)
+        pthread_barrier_destroy(&ctx.barrier);
+
+    free(samples);
+    free(sorter_tids);
+    free(sorter_args);
+    free(ctx.splitters);
+    free(ctx.offsets);
+    free(ctx.bucket_los);
+
+    return retval;
+}
+
+/*
+    External sort of a binary file of elements of any engine type (-T)
+    that need not fit in memory. Sorter threads claim budget-sized runs
+    of the input, sort them and spill them to a temporary file at their
+    input offset, then all runs are merged in one pass. The merge reads the runs and
+    writes the output through an I/O thread, two blocks per stream, so
+    the disk keeps working while the loser tree does.
+*/
+static const size_t EXT_ALIGN = 4096;
+static const size_t EXT_MIN_BLOCK_SZ = 64 << 10;
+
+static int
+preadAll(int fd, char* buf, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t n_read = pread(fd, buf, size, offset);
+        if (n_read == -1 && errno == EINTR)
+            continue;
+
+        if (n_read <= 0)
+        {
+            if (n_read == 0)
+                errno = EIO;     /* the file shrank under us */
+            return -1;
+        }
+
+        buf    += n_read;
+        size   -= (size_t) n_read;
+        offset += n_read;
+    }
+
+    return 0;
+}
+
+static int
+pwriteAll(int fd, const char* buf, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t n_written = pwrite(fd, buf, size, offset);
+        if (n_written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        buf    += n_written;
+        size   -= (size_t) n_written;
+        offset += n_written;
+    }
+
+    return 0;
+}
+
+/*
+    Sorts size elements of args->type with the kernel instantiated for
+    it. int32 goes through sorter() and honours -k, the rest is radix
+    sorted.
+*/
+static int
+typedSort(void* data, size_t size, void* scratch, const Args* args)
+{
+    switch (args->type)
+    {
+        case TYPE_INT32:
+        {
+            Buffer buf = {.data = (int*) data, .size = size};
+            return sorter(&buf, (int*) scratch, args->kernel);
+        }
+        case TYPE_INT64:
+            return radixSortInt64((int64_t*) data, size, (int64_t*) scratch);
+        case TYPE_FLOAT:
+            return radixSortFloat((float*) data, size, (float*) scratch);
+        case TYPE_DOUBLE:
+            return radixSortDouble((double*) data, size, (double*) scratch);
+        case TYPE_RECORD16:
+            return radixSortRecord16((Record16*) data, size, (Record16*) scratch);
+        case N_TYPES:
+        default:
+            assert(0 && "unknown element type");
+            return -1;
+    }
+}
+
+typedef struct
+{
+    const Args*     args;
+    int             fd_in;
+    int             fd_tmp;
+    size_t          file_sz;
+    size_t          run_sz;      /* bytes, the last run may be shorter */
+    size_t          n_runs;
+    size_t          next_run;
+    int             retval;
+    pthread_mutex_t lock;
+} ExtRunGen;
+
+static void*
+extSorterStart(void* arg_ptr)
+{
+    $DBG("external sorter started, stack: %p", &arg_ptr);
+    ExtRunGen* ctx = (ExtRunGen*) arg_ptr;
+    size_t width = ctx->args->width;
+
+    /* allocated here, so the pages are first touched by this thread */
+    void* data    = malloc(ctx->run_sz);
+    void* scratch = malloc(ctx->run_sz);
+
+    for (;;)
+    {
+        int retval = 0;
+
+        pthread_mutex_lock(&ctx->lock);
+        size_t run = ctx->next_run++;
+        if (!data || !scratch)
+            ctx->retval = error("cannot allocate memory\n");
+        if (ctx->retval != 0)
+            run = ctx->n_runs;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (run >= ctx->n_runs)
+            break;
+
+        off_t offset = (off_t) (run * ctx->run_sz);
+        size_t size = ctx->file_sz - run * ctx->run_sz;
+        if (size > ctx->run_sz)
+            size = ctx->run_sz;
+
+        if (preadAll(ctx->fd_in, (char*) data, size, offset) != 0)
+            retval = error("cannot read %s: %s\n", ctx->args->input_path, strerror(errno));
+
+        if (retval == 0 && typedSort(data, size / width, scratch, ctx->args) != 0)
+            retval = error("cannot allocate memory\n");
+
+        if (retval == 0 && pwriteAll(ctx->fd_tmp, (const char*) data, size, offset) != 0)
+            retval = error("cannot write temporary file: %s\n", strerror(errno));
+
+        if (retval != 0)
+        {
+            pthread_mutex_lock(&ctx->lock);
+            ctx->retval = retval;
+            pthread_mutex_unlock(&ctx->lock);
+        }
+    }
+
+    free(data);
+    free(scratch);
+
+    $DBG("external sorter returning");
+    return NULL;
+}
+
+typedef struct
+{
+    int    fd;
+    char*  buf;
+    size_t size;
+    off_t  offset;
+    int    is_write;
+    int    is_done;
+} IoRequest;
+
+/* Queue of block reads and writes served in order by one thread */
+typedef struct
+{
+    IoRequest**     queue;
+    size_t          queue_cap;
+    size_t          head;
+    size_t          n_queued;
+    int             is_stopped;
+    int             error_no;
+    pthread_mutex_t lock;
+    pthread_cond_t  is_queued;
+    pthread_cond_t  is_done;
+} IoThread;
+
+static void
+ioSubmit(IoThread* io, IoRequest* req)
+{
+    pthread_mutex_lock(&io->lock);
+
+    assert(io->n_queued < io->queue_cap);
+
+    req->is_done = 0;
+    io->queue[(io->head + io->n_queued++) % io->queue_cap] = req;
+
+    pthread_cond_signal(&io->is_queued);
+    pthread_mutex_unlock(&io->lock);
+}
+
+/* Returns errno of the first failed request, if any */
+static int
+ioWait(IoThread* io, IoRequest* req)
+{
+    pthread_mutex_lock(&io->lock);
+
+    while (!req->is_done)
+        pthread_cond_wait(&io->is_done, &io->lock);
+
+    int error_no = io->error_no;
+    pthread_mutex_unlock(&io->lock);
+
+    return error_no;
+}
+
+static void*
+ioThreadStart(void* arg_ptr)
+{
+    $DBG("io thread started, stack: %p", &arg_ptr);
+    IoThread* io = (IoThread*) arg_ptr;
+
+    pthread_mutex_lock(&io->lock);
+    for (;;)
+    {
+        while (io->n_queued == 0 && !io->is_stopped)
+            pthread_cond_wait(&io->is_queued, &io->lock);
+
+        if (io->n_queued == 0)
+            break;
+
+        IoRequest* req = io->queue[io->head];
+        io->head = (io->head + 1) % io->queue_cap;
+        io->n_queued--;
+        int is_failed = io->error_no != 0;
+
+        pthread_mutex_unlock(&io->lock);
+
+        int retval = 0;
+        if (!is_failed && req->is_write)
+            retval = pwriteAll(req->fd, req->buf, req->size, req->offset);
+        else if (!is_failed)
+            retval = preadAll(req->fd, req->buf, req->size, req->offset);
+        int error_no = errno;
+
+        pthread_mutex_lock(&io->lock);
+
+        if (retval != 0 && io->error_no == 0)
+            io->error_no = error_no;
+
+        req->is_done = 1;
+        pthread_cond_broadcast(&io->is_done);
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    $DBG("io thread returning");
+    return NULL;
+}
+
+/* A sorted run being merged: blocks[cur] is consumed, the other one is read ahead */
+typedef struct
+{
+    IoRequest blocks[2];
+    int       cur;
+    size_t    pos;
+    off_t     offset;
+    off_t     end;
+} ExtRun;
+
+static void
+extRunRequest(IoThread* io, ExtRun* run, int idx, size_t block_sz)
+{
+    IoRequest* block = &run->blocks[idx];
+
+    block->size = block_sz;
+    if ((off_t) block->size > run->end - run->offset)
+        block->size = (size_t) (run->end - run->offset);
+
+    block->offset = run->offset;
+    run->offset += (off_t) block->size;
+
+    if (block->size == 0)
+        block->is_done = 1;
+    else
+        ioSubmit(io, block);
+}
+
+/* Switches to the read ahead block and reads ahead into the one consumed */
+static int
+extRunNext(IoThread* io, ExtRun* run, size_t block_sz)
+{
+    int consumed = run->cur;
+
+    run->cur ^= 1;
+    run->pos = 0;
+
+    int error_no = ioWait(io, &run->blocks[run->cur]);
+    if (error_no == 0)
+        extRunRequest(io, run, consumed, block_sz);
+
+    return error_no;
+}
+
+static int
+extMerge(const Args* args, int fd_tmp, int fd_out, size_t file_sz,
+         size_t run_sz, size_t n_runs, size_t block_sz)
+{
+    int retval = 0;
+    int is_io_started = 0;
+    pthread_t io_tid = 0;
+    size_t width = args->width;
+    ElemType type = args->type;
+
+    IoThread io = {
+        .queue_cap = 2 * n_runs + 2,
+        .lock      = PTHREAD_MUTEX_INITIALIZER,
+        .is_queued = PTHREAD_COND_INITIALIZER,
+        .is_done   = PTHREAD_COND_INITIALIZER
+    };
+
+    IoRequest out_blocks[2] = {};
+    int out_cur = 0;
+    size_t out_pos = 0;
+    off_t out_offset = 0;
+
+    LoserTree lt = {};
+    io.queue = (IoRequest**) calloc(io.queue_cap, sizeof(IoRequest*));
+    ExtRun* runs = (ExtRun*) calloc(n_runs, sizeof(ExtRun));
+    char* blocks = (char*) malloc((2 * n_runs + 2) * block_sz);
+    if (loserTreeCtor(&lt, n_runs) != 0 || !io.queue || !runs || !blocks)
+    {
+        retval = error("cannot allocate memory\n");
+        goto finally;
+    }
+
+    int err = pthread_create(&io_tid, NULL, ioThreadStart, &io);
+    if (err != 0)
+    {
+        retval = error("cannot start io thread: %s\n", strerror(err));
+        goto finally;
+    }
+    is_io_started = 1;
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        out_blocks[i] = (IoRequest) {
+            .fd       = fd_out,
+            .buf      = blocks + (2 * n_runs + i) * block_sz,
+            .is_write = 1,
+            .is_done  = 1
+        };
+    }
+
+    for (size_t i = 0; i < n_runs; i++)
+    {
+        ExtRun* run = &runs[i];
+
+        run->offset = (off_t) (i * run_sz);
+        run->end    = (off_t) ((i + 1) * run_sz < file_sz ? (i + 1) * run_sz : file_sz);
+
+        for (int idx = 0; idx < 2; idx++)
+        {
+            run->blocks[idx] = (IoRequest) {
+                .fd  = fd_tmp,
+                .buf = blocks + (2 * i + (size_t) idx) * block_sz
+            };
+            extRunRequest(&io, run, idx, block_sz);
+        }
+    }
+
+    for (size_t i = 0; i < n_runs; i++)
+    {
+        int error_no = ioWait(&io, &runs[i].blocks[0]);
+        if (error_no != 0)
+        {
+            retval = error("cannot read temporary file: %s\n", strerror(error_no));
+            goto finally;
+        }
+
+        lt.keys[i] = elemKey(runs[i].blocks[0].buf, type);
+    }
+
+    loserTreeInit(&lt);
+
+    for (size_t n_merged = 0; n_merged < file_sz && retval == 0; n_merged += width)
+    {
+        size_t winner = loserTreeWinner(&lt);
+        ExtRun* run = &runs[winner];
+        IoRequest* block = &run->blocks[run->cur];
+
+        memcpy(out_blocks[out_cur].buf + out_pos, block->buf + run->pos, width);
+        out_pos  += width;
+        run->pos += width;
+
+        if (run->pos == block->size)
+        {
+            int error_no = extRunNext(&io, run, block_sz);
+            if (error_no != 0)
+            {
+                /* the failed block holds no data to take a key from */
+                retval = error("cannot read temporary file: %s\n", strerror(error_no));
+                goto finally;
+            }
+
+            block = &run->blocks[run->cur];
+            if (block->size == 0)
+                lt.is_empty[winner] = 1;
+        }
+
+        if (!lt.is_empty[winner])
+            lt.keys[winner] = elemKey(block->buf + run->pos, type);
+
+        loserTreeReplay(&lt);
+
+        /* hand the full block to the io thread, take the other one */
+        if (out_pos == block_sz || n_merged + width == file_sz)
+        {
+            out_blocks[out_cur].size   = out_pos;
+            out_blocks[out_cur].offset = out_offset;
+            ioSubmit(&io, &out_blocks[out_cur]);
+
+            out_offset += (off_t) out_pos;
+            out_pos = 0;
+            out_cur ^= 1;
+
+            int error_no = ioWait(&io, &out_blocks[out_cur]);
+            if (error_no != 0)
+                retval = error("cannot write %s: %s\n", args->output_path, strerror(error_no));
+        }
+    }
+
+    if (retval == 0)
+    {
+        int error_no = ioWait(&io, &out_blocks[out_cur ^ 1]);
+        if (error_no != 0)
+            retval = error("cannot write %s: %s\n", args->output_path, strerror(error_no));
+    }
+
+finally:
+    if (is_io_started)
+    {
+        pthread_mutex_lock(&io.lock);
+        io.is_stopped = 1;
+        pthread_cond_signal(&io.is_queued);
+        pthread_mutex_unlock(&io.lock);
+
+        pthread_join(io_tid, NULL);
+    }
+
+    loserTreeDtor(&lt);
+    free(io.queue);
+    free(runs);
+    free(blocks);
+
+    return retval;
+}
+
+static int
+externalSort(const Args* args, double* phase_ms)
+{
+    int retval = 0;
+    int fd_in  = -1;
+    int fd_out = -1;
+    int fd_tmp = -1;
+    pthread_t* sorter_tids = NULL;
+    size_t n_started = 0;
+    size_t width = args->width;
+
+    ExtRunGen ctx = {
+        .args = args,
+        .lock = PTHREAD_MUTEX_INITIALIZER
+    };
+
+    fd_in = open(args->input_path, O_RDONLY);
+    if (fd_in == -1)
+    {
+        retval = error("cannot open %s: %s\n", args->input_path, strerror(errno));
+        goto finally;
+    }
+
+    struct stat stat_in = {};
+    if (fstat(fd_in, &stat_in) != 0)
+    {
+        retval = error("cannot stat %s: %s\n", args->input_path, strerror(errno));
+        goto finally;
+    }
+
+    size_t file_sz = (size_t) stat_in.st_size;
+    if (file_sz % width != 0)
+    {
+        retval = error("%s: size %zu is not a multiple of %zu bytes\n",
+                       args->input_path, file_sz, width);
+        goto finally;
+    }
+
+    /* every sorter holds a run and its radix scratch */
+    size_t run_sz = args->mem_budget / (2 * args->n_threads) / EXT_ALIGN * EXT_ALIGN;
+    if (run_sz == 0)
+    {
+        retval = error("memory budget %zu is too small for %zu threads\n",
+                       args->mem_budget, args->n_threads);
+        goto finally;
+    }
+
+    /* the merge holds two blocks per run and two output blocks */
+    size_t n_runs = (file_sz + run_sz - 1) / run_sz;
+    size_t block_sz = args->mem_budget / (2 * n_runs + 2) / EXT_ALIGN * EXT_ALIGN;
+    if (block_sz < EXT_MIN_BLOCK_SZ)
+    {
+        retval = error("memory budget %zu is too small to merge %zu runs in one pass\n",
+                       args->mem_budget, n_runs);
+        goto finally;
+    }
+
+    const char* tmp_dir = getenv("TMPDIR");
+    char tmp_path[PATH_MAX] = {};
+    snprintf(tmp_path, sizeof(tmp_path), "%s/threadsort.XXXXXX", tmp_dir ? tmp_dir : "/tmp");
+
+    fd_tmp = mkstemp(tmp_path);
+    if (fd_tmp == -1)
+    {
+        retval = error("cannot create %s: %s\n", tmp_path, strerror(errno));
+        goto finally;
+    }
+    unlink(tmp_path);
+
+    fd_out = open(args->output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_out == -1)
+    {
+        retval = error("cannot open %s: %s\n", args->output_path, strerror(errno));
+        goto finally;
+    }
+
+    ctx.fd_in   = fd_in;
+    ctx.fd_tmp  = fd_tmp;
+    ctx.file_sz = file_sz;
+    ctx.run_sz  = run_sz;
+    ctx.n_runs  = n_runs;
+
+    size_t n_sorters = args->n_threads < n_runs ? args->n_threads : n_runs;
+    sorter_tids = (pthread_t*) calloc(n_sorters + 1, sizeof(pthread_t));
+    if (!sorter_tids)
+    {
+        retval = error("cannot allocate memory\n");
+        goto finally;
+    }
+
+    $DBG("starting %zu external sorters for %zu runs of %zu KiB", n_sorters, n_runs, run_sz >> 10);
+    double runs_start = nowMs();
+    for (; n_started < n_sorters; n_started++)
+    {
+        int err = startThread(&sorter_tids[n_started], &args->placement, n_started, extSorterStart, &ctx);
+        if (err != 0)
+        {
+            retval = error("cannot start sorter: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < n_started; i++)
+        pthread_join(sorter_tids[i], NULL);
+
+    if (retval != 0 || ctx.retval != 0)
+    {
+        retval = 1;
+        goto finally;
+    }
+
+    phase_ms[PHASE_SORT] = nowMs() - runs_start;
+
+    $DBG("merging %zu runs, %zu KiB blocks", n_runs, block_sz >> 10);
+    double merge_start = nowMs();
+    retval = extMerge(args, fd_tmp, fd_out, file_sz, run_sz, n_runs, block_sz);
+
+    phase_ms[PHASE_MERGE] = nowMs() - merge_start;
+
+finally:
+    if (fd_in != -1)
+        close(fd_in);
+    if (fd_tmp != -1)
+        close(fd_tmp);
+    if (fd_out != -1 && close(fd_out) != 0 && retval == 0)
+        retval = error("cannot write %s: %s\n", args->output_path, strerror(errno));
+
+    free(sorter_tids);
+
+    return retval;
+}
+
+typedef struct
+{
+    Buffer*     buf;
+    size_t      lo;
+    size_t      hi;
+    const Args* args;
+} GenArgs;
+
+static void*
+genStart(void* arg_ptr)
+{
+    GenArgs* ptr = (GenArgs*) arg_ptr;
+
+    genData(ptr->buf, ptr->lo, ptr->hi, ptr->args->dist, ptr->args->seed);
+
+    return NULL;
+}
+
+/*
+    Every thread generates the slice its sorter will get, on the same CPU,
+    so the pages are first touched, and allocated, on the sorter's node.
+*/
+static int
+parallelGen(Buffer* buf, const Args* args)
+{
+    int retval = 0;
+    size_t n_threads = args->n_threads;
+    size_t n_started = 0;
+
+    pthread_t* gen_tids = (pthread_t*) calloc(n_threads, sizeof(pthread_t));
+    GenArgs* gen_args = (GenArgs*) calloc(n_threads, sizeof(GenArgs));
+    if (!gen_tids || !gen_args)
+    {
+        free(gen_tids);
+        free(gen_args);
+        return error("cannot allocate memory\n");
+    }
+
+    for (; n_started < n_threads; n_started++)
+    {
+        size_t i = n_started;
+
+        gen_args[i] = (GenArgs) {
+            .buf  = buf,
+            .lo   = buf->size * i / n_threads,
+            .hi   = buf->size * (i + 1) / n_threads,
+            .args = args
+        };
+
+        int err = startThread(&gen_tids[i], &args->placement, i, genStart, &gen_args[i]);
+        if (err != 0)
+        {
+            retval = error("cannot start generator: %s\n", strerror(err));
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < n_started; i++)
+        pthread_join(gen_tids[i], NULL);
+
+    free(gen_tids);
+    free(gen_args);
+
+    return retval;
+}
+
+/* One generate, sort, check cycle of data_sz ints in memory */
+static int
+memorySort(const Args* args, double* phase_ms)
+{
+    int retval = 0;
+    size_t data_sz = args->data_sz;
+
+    Buffer init_data = {
+        .data = (int*) malloc(data_sz * sizeof(int)),
+        .size = data_sz
+    };
+
+    /* the result ends up in scratch with either mode */
+    int* scratch = (int*) malloc(data_sz * sizeof(int));
+    if (!init_data.data || !scratch)
+    {
+        retval = error("cannot allocate memory\n");
+        goto finally;
+    }
+
+    Buffer sorted_data = {
+        .data = scratch,
+        .size = data_sz
+    };
+
+    /* generate data */
+    double gen_start = nowMs();
+    retval = parallelGen(&init_data, args);
+    phase_ms[PHASE_GEN] = nowMs() - gen_start;
+
+    if (retval != 0)
+        goto finally;
+
+    if (args->is_printing)
+        printBuffer(&init_data);
+
+    double checksum_start = nowMs();
+    uint64_t raw_checksum = checksum(&init_data);
+    phase_ms[PHASE_CHECK] = nowMs() - checksum_start;
+
+    if (args->mode == MODE_SAMPLE)
+        retval = sampleSort(&init_data, scratch, args, phase_ms);
+    else
+        retval = mergeSort(&init_data, scratch, args, phase_ms);
+
+    if (retval != 0)
+        goto finally;
+
+    if (args->is_printing)
+        printBuffer(&sorted_data);
+
+    /* check data */
+    $DBG("checker");
+    double check_start = nowMs();
+    retval = checker(raw_checksum, &sorted_data);
+    phase_ms[PHASE_CHECK] += nowMs() - check_start;
+
+finally:
+    free(init_data.data);
+    free(scratch);
+
+    return retval;
+}
+
+static int
+compareDoubles(const void* a, const void* b)
+{
+    double arg1 = *(const double*)a;
+    double arg2 = *(const double*)b;
+
+    if (arg1 < arg2) return -1;
+    if (arg1 > arg2) return 1;
+    return 0;
+}
+
+/* Nearest rank percentile of sorted values */
+static double
+percentile(const double* values, size_t n_values, double fraction)
+{
+    return values[(size_t) (fraction * (double) (n_values - 1) + 0.5)];
+}
+
+/*
+    Per phase minimum, median, 90th percentile and maximum over the
+    repetitions, phases that never ran are left out. rep_ms holds
+    N_PHASES times per repetition.
+*/
+static void
+printReport(const Args* args, const double* rep_ms)
+{
+    size_t n_reps = args->n_reps;
+    const char* mode = args->input_path          ? "external"
+                     : args->mode == MODE_SAMPLE ? "sample" : "merge";
+    const char* dist = args->input_path ? TYPE_NAMES[args->type] : DIST_NAMES[args->dist];
+    const char* affinity = args->placement.policy ? args->placement.policy : "none";
+
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+
+    double* values = (double*) malloc(n_reps * sizeof(double));
+    if (!values)
+    {
+        error("cannot allocate memory\n");
+        return;
+    }
+
+    switch (args->format)
+    {
+        case FORMAT_TEXT:
+            printf("%s, %s, %s, affinity %s, %zu elements, %zu threads, %zu reps, "
+                   "peak rss %ld KiB\n", mode, KERNEL_NAMES[args->kernel], dist, affinity,
+                   args->data_sz, args->n_threads, n_reps, usage.ru_maxrss);
+            printf("%-8s %12s %12s %12s %12s\n", "phase", "min ms", "p50 ms", "p90 ms", "max ms");
+            break;
+        case FORMAT_CSV:
+            printf("mode,kernel,dist,affinity,data_sz,n_threads,reps,phase,min_ms,p50_ms,p90_ms,max_ms\n");
+            break;
+        case FORMAT_JSON:
+            printf("{\"mode\": \"%s\", \"kernel\": \"%s\", \"dist\": \"%s\", \"affinity\": \"%s\", "
+                   "\"data_sz\": %zu, \"n_threads\": %zu, \"reps\": %zu, \"peak_rss_kib\": %ld, "
+                   "\"phases\": {", mode, KERNEL_NAMES[args->kernel], dist, affinity,
+                   args->data_sz, args->n_threads, n_reps, usage.ru_maxrss);
+            break;
+        default:
+            break;
+    }
+
+    int is_first = 1;
+    for (size_t phase = 0; phase <= N_PHASES; phase++)
+    {
+        /* the extra phase is the total */
+        const char* name = phase < N_PHASES ? PHASE_NAMES[phase] : "total";
+        int is_run = 0;
+
+        for (size_t rep = 0; rep < n_reps; rep++)
+        {
+            const double* ms = rep_ms + rep * N_PHASES;
+
+            values[rep] = 0;
+            for (size_t i = 0; i < N_PHASES; i++)
+            {
+                if (i == phase || phase == N_PHASES)
+                    values[rep] += ms[i];
+            }
+
+            is_run |= values[rep] > 0;
+        }
+
+        if (!is_run)
+            continue;
+
+        qsort(values, n_reps, sizeof(double), compareDoubles);
+
+        double min = values[0];
+        double p50 = percentile(values, n_reps, 0.5);
+        double p90 = percentile(values, n_reps, 0.9);
+        double max = values[n_reps - 1];
+
+        switch (args->format)
+        {
+            case FORMAT_TEXT:
+                printf("%-8s %12.3f %12.3f %12.3f %12.3f\n", name, min, p50, p90, max);
+                break;
+            case FORMAT_CSV:
+                printf("%s,%s,%s,%s,%zu,%zu,%zu,%s,%.3f,%.3f,%.3f,%.3f\n",
+                       mode, KERNEL_NAMES[args->kernel], dist, affinity,
+                       args->data_sz, args->n_threads, n_reps, name, min, p50, p90, max);
+                break;
+            case FORMAT_JSON:
+                printf("%s\"%s\": {\"min_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"max_ms\": %.3f}",
+                       is_first ? "" : ", ", name, min, p50, p90, max);
+                break;
+            default:
+                break;
+        }
+
+        is_first = 0;
+    }
+
+    if (args->format == FORMAT_JSON)
+        printf("}}\n");
+
+    free(values);
+}
+
+int
+main(int argc, char* argv[])
+{
+    PROGNAME = argv[0];
+
+    Args args = {};
+    if (parseArgs(argc, argv, &args) != 0)
+    {
+        cpuPlacementDtor(&args.placement);
+        return 1;
+    }
+
+    double* rep_ms = (double*) calloc(args.n_reps * N_PHASES, sizeof(double));
+    if (!rep_ms)
+        return error("cannot allocate memory\n");
+
+    /* for the report */
+    struct stat stat_in = {};
+    if (args.input_path && stat(args.input_path, &stat_in) == 0)
+        args.data_sz = (size_t) stat_in.st_size / args.width;
+
+    int retval = 0;
+    for (size_t rep = 0; rep < args.n_reps && retval == 0; rep++)
+    {
+        $DBG("repetition %zu", rep);
+
+        if (args.input_path)
+            retval = externalSort(&args, rep_ms + rep * N_PHASES);
+        else
+            retval = memorySort(&args, rep_ms + rep * N_PHASES);
+    }
+
+    if (retval == 0 && args.is_timing)
+        printReport(&args, rep_ms);
+
+    free(rep_ms);
+    cpuPlacementDtor(&args.placement);
+
+    $DBG("main returning");
+
+    return retval;
 }